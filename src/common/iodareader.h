@@ -0,0 +1,345 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "eckit/config/LocalConfiguration.h"
+#include "eckit/exception/Exceptions.h"
+#include "eckit/mpi/Comm.h"
+
+#include "ioda/Engines/EngineUtils.h"
+#include "ioda/Group.h"
+#include "ioda/ObsSpace.h"
+
+#include "oops/mpi/mpi.h"
+#include "oops/util/DateTime.h"
+#include "oops/util/Duration.h"
+#include "oops/util/Logger.h"
+#include "oops/util/TimeWindow.h"
+
+namespace dautils {
+  // -----------------------------------------------------------------------------
+  // what the statistics need from an obs file: the number of local locations and
+  // the values of group/variable (for a list of channels, interleaved per location)
+  class ObsSource {
+    public:
+    virtual ~ObsSource() = default;
+    // locations of the current selection inside the time window
+    virtual size_t nlocs() const = 0;
+
+    // readers able to stream over the file read a block of locations at a time:
+    // sliceSize is the number of locations of this rank in the file, selectLocations
+    // restricts nlocs and get_db to a block of them and must be called before any
+    // of them, with the whole slice when not streaming. Others only have one block
+    virtual size_t sliceSize() const { return nlocs(); }
+    virtual void selectLocations(const size_t first, const size_t count) {
+      if (first != 0 || count != sliceSize()) {
+        throw eckit::UserError("streaming over locations needs direct read");
+      }
+    }
+    // HDF5 chunk size along the locations, 0 when unknown or not chunked
+    virtual size_t fileChunkSize() const { return 0; }
+    // channel numbers of the file, empty when it has no channels
+    virtual std::vector<int> channels() const { return {}; }
+
+    // seconds from start to MetaData/dateTime of every location
+    virtual void secondsSince(const util::DateTime & start,
+                              std::vector<int64_t> & seconds) const = 0;
+
+    void get_db(const std::string & group, const std::string & name,
+                std::vector<float> & values, const std::vector<int> & channels = {}) const {
+      read(group, name, values, channels);
+    }
+    void get_db(const std::string & group, const std::string & name,
+                std::vector<int> & values, const std::vector<int> & channels = {}) const {
+      read(group, name, values, channels);
+    }
+
+    protected:
+    virtual void read(const std::string & group, const std::string & name,
+                      std::vector<float> & values, const std::vector<int> & channels) const = 0;
+    virtual void read(const std::string & group, const std::string & name,
+                      std::vector<int> & values, const std::vector<int> & channels) const = 0;
+  };
+
+  // -----------------------------------------------------------------------------
+  // channel numbers of the Channel variable of an obs file, empty without one
+  inline std::vector<int> fileChannels(const ioda::Group & file) {
+    std::vector<int> channels;
+    if (file.vars.exists("Channel")) {
+      const ioda::Variable channelVar = file.vars.open("Channel");
+      channels.resize(channelVar.getDimensions().numElements);
+      channelVar.read<int>(gsl::make_span(channels.data(), channels.size()));
+    }
+    return channels;
+  }
+
+  // -----------------------------------------------------------------------------
+  // the file read through a full ioda::ObsSpace
+  class ObsSpaceSource : public ObsSource {
+    public:
+    ObsSpaceSource(const eckit::Configuration & obsConfig, const util::TimeWindow & timeWindow,
+                   const eckit::mpi::Comm & comm)
+      : ospace_(obsConfig, comm, timeWindow, oops::mpi::myself()),
+        channels_(ospace_.obsvariables().channels()) {
+      // simulated variables listed without channels: the channels are those of the file
+      std::string engine = "H5File";
+      if (obsConfig.has("obsdatain.engine.type")) {
+        obsConfig.get("obsdatain.engine.type", engine);
+      }
+      if (channels_.empty() && engine == "H5File") {
+        ioda::Engines::BackendCreationParameters backendParams;
+        backendParams.fileName = obsConfig.getString("obsdatain.engine.obsfile");
+        backendParams.action = ioda::Engines::BackendFileActions::Open;
+        backendParams.openMode = ioda::Engines::BackendOpenModes::Read_Only;
+        channels_ = fileChannels(ioda::Engines::constructBackend(
+                                   ioda::Engines::BackendNames::Hdf5File, backendParams));
+      }
+    }
+
+    size_t nlocs() const override { return ospace_.nlocs(); }
+    std::vector<int> channels() const override { return channels_; }
+
+    void secondsSince(const util::DateTime & start, std::vector<int64_t> & seconds) const override {
+      std::vector<util::DateTime> dateTimes;
+      ospace_.get_db("MetaData", "dateTime", dateTimes);
+      seconds.resize(dateTimes.size());
+      for (size_t i = 0; i < dateTimes.size(); i++) {
+        seconds[i] = (dateTimes[i] - start).toSeconds();
+      }
+    }
+
+    protected:
+    void read(const std::string & group, const std::string & name,
+              std::vector<float> & values, const std::vector<int> & channels) const override {
+      ospace_.get_db(group, name, values, channels);
+    }
+    void read(const std::string & group, const std::string & name,
+              std::vector<int> & values, const std::vector<int> & channels) const override {
+      ospace_.get_db(group, name, values, channels);
+    }
+
+    private:
+    ioda::ObsSpace ospace_;
+    std::vector<int> channels_;
+  };
+
+  // -----------------------------------------------------------------------------
+  // the file read straight from the HDF5 backend: nothing is loaded up front, each
+  // get_db only reads the requested variable and channels over the selected
+  // locations, and the time window is applied from MetaData/dateTime.
+  // Ranks of comm read contiguous slices of the locations, split on the HDF5 chunks,
+  // which are read a block of locations at a time with selectLocations. Nothing is
+  // read before the first block is selected, so the buffers of the reader are sized
+  // for one block and its memory does not grow with the size of the file
+  class IodaReader : public ObsSource {
+    public:
+    IodaReader(const eckit::Configuration & obsConfig, const util::TimeWindow & timeWindow,
+               const eckit::mpi::Comm & comm) {
+      std::string engine = "H5File";
+      if (obsConfig.has("obsdatain.engine.type")) {
+        obsConfig.get("obsdatain.engine.type", engine);
+      }
+      if (engine != "H5File") {
+        throw eckit::BadValue("IodaReader: direct read only supports the H5File engine, not "
+                              + engine);
+      }
+      obsConfig.get("obsdatain.engine.obsfile", filename_);
+      ioda::Engines::BackendCreationParameters backendParams;
+      backendParams.fileName = filename_;
+      backendParams.action = ioda::Engines::BackendFileActions::Open;
+      backendParams.openMode = ioda::Engines::BackendOpenModes::Read_Only;
+      file_ = ioda::Engines::constructBackend(ioda::Engines::BackendNames::Hdf5File,
+                                              backendParams);
+
+      // window bounds in the units of dateTime, the bounds themselves are left
+      // to TimeWindow which knows which of them is included
+      dateTime_ = open("MetaData", "dateTime");
+      epoch_ = dateTimeEpoch(dateTime_);
+      windowStart_ = (timeWindow.start() - epoch_).toSeconds();
+      windowEnd_ = (timeWindow.end() - epoch_).toSeconds();
+      keepStart_ = timeWindow.contains(timeWindow.start());
+      keepEnd_ = timeWindow.contains(timeWindow.end());
+
+      // this rank's slice of the locations, whole HDF5 chunks when the file is chunked
+      const size_t nlocsFile = dateTime_.getDimensions().dimsCur[0];
+      const std::vector<ioda::Dimensions_t> chunks = dateTime_.getChunkSizes();
+      fileChunk_ = chunks.empty() ? 0 : static_cast<size_t>(chunks[0]);
+      const size_t unit = std::max<size_t>(1, fileChunk_);
+      const size_t nunits = (nlocsFile + unit - 1) / unit;
+      sliceFirst_ = std::min(nlocsFile, unit * (nunits * comm.rank() / comm.size()));
+      sliceCount_ = std::min(nlocsFile, unit * (nunits * (comm.rank() + 1) / comm.size()))
+                    - sliceFirst_;
+      fileChannels_ = fileChannels(file_);
+    }
+
+    size_t nlocs() const override { return keep_.size(); }
+    size_t sliceSize() const override { return sliceCount_; }
+    size_t fileChunkSize() const override { return fileChunk_; }
+    std::vector<int> channels() const override { return fileChannels_; }
+
+    // dateTime was already read by selectLocations
+    void secondsSince(const util::DateTime & start, std::vector<int64_t> & seconds) const override {
+      const int64_t offset = (epoch_ - start).toSeconds();
+      seconds.resize(keep_.size());
+      for (size_t i = 0; i < keep_.size(); i++) seconds[i] = seconds_[keep_[i]] + offset;
+    }
+
+    // restrict the next reads to locations [first, first + count) of this rank's slice.
+    // the buffers shrink back when a smaller block follows a bigger one
+    void selectLocations(const size_t first, const size_t count) override {
+      first_ = sliceFirst_ + first;
+      count_ = count;
+      if (seconds_.capacity() > 2 * count_) {
+        std::vector<int64_t>().swap(seconds_);
+        std::vector<size_t>().swap(keep_);
+        std::vector<float>().swap(floatBlock_);
+        std::vector<int>().swap(intBlock_);
+      }
+      readSlice(dateTime_, 0, 1, seconds_);
+      keep_.clear();
+      keep_.reserve(count_);
+      for (size_t i = 0; i < count_; i++) {
+        const int64_t t = seconds_[i];
+        if ((t > windowStart_ && t < windowEnd_) || (t == windowStart_ && keepStart_)
+            || (t == windowEnd_ && keepEnd_)) {
+          keep_.push_back(i);
+        }
+      }
+      allKept_ = keep_.size() == count_;
+      if (count_ == sliceCount_) {
+        oops::Log::info() << "IodaReader: " << filename_ << " " << keep_.size() << " of "
+                          << count_ << " locations of this rank in the time window" << std::endl;
+      }
+    }
+
+    protected:
+    void read(const std::string & group, const std::string & name,
+              std::vector<float> & values, const std::vector<int> & channels) const override {
+      readVariable(group, name, values, channels, floatBlock_);
+    }
+    void read(const std::string & group, const std::string & name,
+              std::vector<int> & values, const std::vector<int> & channels) const override {
+      readVariable(group, name, values, channels, intBlock_);
+    }
+
+    private:
+    ioda::Variable open(const std::string & group, const std::string & name) const {
+      const std::string path = group + "/" + name;
+      if (!file_.vars.exists(path)) {
+        throw eckit::BadValue("IodaReader: " + filename_ + " has no " + path);
+      }
+      return file_.vars.open(path);
+    }
+
+    // reads the selected locations of the requested channels and interleaves them per
+    // location as ObsSpace::get_db does. A Location x Channel variable is read in one
+    // hyperslab over the columns from the first to the last requested channel, so each
+    // HDF5 chunk is read once, and the channels are gathered from it in memory.
+    // block is kept between calls so streaming over blocks of locations does not allocate
+    template <typename T>
+    void readVariable(const std::string & group, const std::string & name,
+                      std::vector<T> & values, const std::vector<int> & channels,
+                      std::vector<T> & block) const {
+      const ioda::Variable var = open(group, name);
+      const size_t nchans = std::max<size_t>(1, channels.size());
+      std::vector<size_t> columns(nchans, 0);
+      for (size_t c = 0; c < channels.size(); c++) {
+        const auto it = std::find(fileChannels_.begin(), fileChannels_.end(), channels[c]);
+        if (it == fileChannels_.end()) {
+          throw eckit::BadValue("IodaReader: " + filename_ + " has no channel "
+                                + std::to_string(channels[c]));
+        }
+        columns[c] = it - fileChannels_.begin();
+      }
+      // a variable without channels has the same value for all of them
+      if (var.getDimensions().dimensionality == 1) std::fill(columns.begin(), columns.end(), 0);
+      const size_t firstColumn = *std::min_element(columns.begin(), columns.end());
+      const size_t ncols = *std::max_element(columns.begin(), columns.end()) + 1 - firstColumn;
+      // already in place when all locations are kept and the columns are contiguous
+      bool inPlace = allKept_;
+      for (size_t c = 0; c < nchans; c++) inPlace = inPlace && columns[c] == firstColumn + c;
+      if (inPlace && ncols == nchans) {
+        readSlice(var, firstColumn, ncols, values);
+        return;
+      }
+      readSlice(var, firstColumn, ncols, block);
+      values.resize(keep_.size() * nchans);
+      for (size_t i = 0; i < keep_.size(); i++) {
+        const T * row = block.data() + keep_[i] * ncols;
+        for (size_t c = 0; c < nchans; c++) values[i * nchans + c] = row[columns[c] - firstColumn];
+      }
+    }
+
+    // locations first_ to first_ + count_ of a 1D variable, or of ncols columns from
+    // firstColumn of a Location x Channel variable, location after location
+    template <typename T>
+    void readSlice(const ioda::Variable & var, const size_t firstColumn, const size_t ncols,
+                   std::vector<T> & out) const {
+      const ioda::Dimensions dims = var.getDimensions();
+      const ioda::Dimensions_t first = first_, count = count_, col = firstColumn, width = ncols;
+      ioda::Selection fileSelection;
+      ioda::Selection memSelection;
+      if (dims.dimensionality == 1) {
+        fileSelection.extent(dims.dimsCur)
+                     .select({ioda::SelectionOperator::SET, {first}, {count}});
+        memSelection.extent({count}).select({ioda::SelectionOperator::SET, {0}, {count}});
+      } else {
+        fileSelection.extent(dims.dimsCur)
+                     .select({ioda::SelectionOperator::SET, {first, col}, {count, width}});
+        memSelection.extent({count, width})
+                    .select({ioda::SelectionOperator::SET, {0, 0}, {count, width}});
+      }
+      out.resize(count_ * (dims.dimensionality == 1 ? 1 : ncols));
+      var.read<T>(gsl::make_span(out.data(), out.size()), memSelection, fileSelection);
+    }
+
+    // reference time of dateTime, from its "seconds since ..." units
+    static util::DateTime dateTimeEpoch(const ioda::Variable & dateTime) {
+      std::string units = "seconds since 1970-01-01T00:00:00Z";
+      if (dateTime.atts.exists("units")) {
+        units = dateTime.atts.open("units").read<std::string>();
+      }
+      const std::string prefix = "seconds since ";
+      if (units.compare(0, prefix.size(), prefix) != 0) {
+        throw eckit::BadValue("IodaReader: unsupported MetaData/dateTime units " + units);
+      }
+      return util::DateTime(units.substr(prefix.size()));
+    }
+
+    std::string filename_;
+    ioda::Group file_;
+    ioda::Variable dateTime_;
+    util::DateTime epoch_;
+    int64_t windowStart_ = 0;
+    int64_t windowEnd_ = 0;
+    bool keepStart_ = true;
+    bool keepEnd_ = true;
+    size_t fileChunk_ = 0;
+    size_t sliceFirst_ = 0;   // locations of this rank in the file
+    size_t sliceCount_ = 0;
+    size_t first_ = 0;        // selected locations in the file
+    size_t count_ = 0;
+    std::vector<int64_t> seconds_;
+    std::vector<size_t> keep_;   // selected locations inside the time window
+    bool allKept_ = false;
+    std::vector<int> fileChannels_;
+    mutable std::vector<float> floatBlock_;
+    mutable std::vector<int> intBlock_;
+  };
+
+  // -----------------------------------------------------------------------------
+  // the reader of an "obs space" configuration, direct or through ioda::ObsSpace
+  inline std::unique_ptr<ObsSource> openObsSource(const eckit::Configuration & obsConfig,
+                                                  const util::TimeWindow & timeWindow,
+                                                  const eckit::mpi::Comm & comm,
+                                                  const bool direct) {
+    if (direct) {
+      return std::make_unique<IodaReader>(obsConfig, timeWindow, comm);
+    }
+    return std::make_unique<ObsSpaceSource>(obsConfig, timeWindow, comm);
+  }
+}  // namespace dautils
@@ -1,7 +1,8 @@
 #pragma once
 
+#include <algorithm>
 #include <iostream>
-#include <numeric>
+#include <memory>
 #include <string>
 #include <vector>
 #include "eckit/config/LocalConfiguration.h"
@@ -17,14 +18,17 @@
 #include "oops/util/DateTime.h"
 #include "oops/util/Duration.h"
 #include "oops/util/Logger.h"
+#include "oops/util/missingValues.h"
 #include "oops/util/TimeWindow.h"
 
+#include "common/iodareader.h"
+
 namespace dautils {
   // this is an example of how one can use OOPS and IODA to do something
   // in this code, we will read in configuration from YAML
   // and then use that configuration to read in a IODA formatted file,
-  // read one group/variable (with optional channel)
-  // and compute and print out the mean of the variable.
+  // read one group/variable (with optional channel), or a batch of them,
+  // and compute and print out the mean of each variable.
   // Nothing fancy, but you can see how this could be expanded!
 
   class IodaExample : public oops::Application {
@@ -42,58 +46,114 @@ namespace dautils {
       const eckit::LocalConfiguration timeWindowConf(fullConfig, "time window");
       const util::TimeWindow timeWindow(timeWindowConf);
 
-      // what variable to get the mean of
-      std::string group;
-      std::string variable;
-      fullConfig.get("group", group);
-      fullConfig.get("variable", variable);
-      int chan = 0;
-      if (fullConfig.has("channel")) {
-        fullConfig.get("channel", chan);
+      // what variables to get the mean of: either one group/variable (with an optional
+      // channel), or in batch mode lists of "groups" and "variables" with optional
+      // "channels" (or "all channels: true"), all read from a single open of the file
+      std::vector<std::string> groups;
+      std::vector<std::string> variables;
+      std::vector<int> channels;
+      bool allChannels = false;
+      // only the batch mode has a Channel dimension in the output
+      bool channelDim = false;
+      if (fullConfig.has("groups") || fullConfig.has("variables")) {
+        fullConfig.get("groups", groups);
+        fullConfig.get("variables", variables);
+        if (fullConfig.has("channels")) {
+          fullConfig.get("channels", channels);
+        }
+        if (fullConfig.has("all channels")) {
+          fullConfig.get("all channels", allChannels);
+        }
+        channelDim = allChannels || !channels.empty();
+      } else {
+        groups.push_back(fullConfig.getString("group"));
+        variables.push_back(fullConfig.getString("variable"));
+        int chan = 0;
+        if (fullConfig.has("channel")) {
+          fullConfig.get("channel", chan);
+        }
+        // give it the channel as a single item list
+        if (chan != 0) channels.push_back(chan);
       }
 
       // read the obs space
-      // Note, the below line does a lot of heavy lifting
-      // we can probably go to a lower level function
-      // (and more of them) to accomplish the same thing
-      ioda::ObsSpace ospace(obsConfig, oops::mpi::world(), timeWindow,
-                            oops::mpi::myself());
+      // Note, building an ObsSpace does a lot of heavy lifting, so it is done once
+      // for everything, with direct read only the variables below are read from the file
+      bool directRead = false;
+      if (fullConfig.has("direct read")) {
+        fullConfig.get("direct read", directRead);
+      }
+      const std::unique_ptr<ObsSource> source = openObsSource(obsConfig, timeWindow,
+                                                              getComm(), directRead);
+      // every location of this rank in one block
+      source->selectLocations(0, source->sliceSize());
+      const ObsSource & ospace = *source;
       const size_t nlocs = ospace.nlocs();
       oops::Log::info() << "nlocs =" << nlocs << std::endl;
-      std::vector<float> buffer(nlocs);
-
-      // below is grabbing from the IODA obs space
-      // the specified group/variable and putting it into the buffer
-      if (chan == 0) {
-        // no channel is selected
-        ospace.get_db(group, variable, buffer);
-      } else {
-        // give it the channel as a single item list
-        ospace.get_db(group, variable, buffer, {chan});
+      if (allChannels) {
+        channels = ospace.channels();
+        if (channels.empty()) {
+          throw eckit::UserError("all channels: the obs space has no channels");
+        }
+      }
+      const size_t nchans = std::max<size_t>(1, channels.size());
+
+      // below is grabbing from the IODA obs space each group/variable, all its
+      // channels at once, and computing the mean of every channel in one pass
+      // over the buffer. Missing values are left out, and the sums and counts
+      // of every rank are added up so the mean is over the whole file
+      std::vector<float> buffer;
+      std::vector<double> sums(groups.size() * variables.size() * nchans, 0.0);
+      std::vector<double> counts(sums.size(), 0.0);
+      for (size_t g = 0; g < groups.size(); g++) {
+        for (size_t var = 0; var < variables.size(); var++) {
+          ospace.get_db(groups[g], variables[var], buffer, channels);
+          const size_t first = (g * variables.size() + var) * nchans;
+          sumValues(buffer, nchans, &sums[first], &counts[first]);
+        }
       }
+      getComm().allReduceInPlace(sums.data(), sums.size(), eckit::mpi::sum());
+      getComm().allReduceInPlace(counts.data(), counts.size(), eckit::mpi::sum());
 
-      // the below line computes the mean, aka sum divided by count
-      const float mean = std::accumulate(buffer.begin(), buffer.end(), 0) /
-                         static_cast<float>(nlocs);
+      // the mean is sum divided by count, or missing without any valid value
+      std::vector<float> means(sums.size(), util::missingValue<float>());
+      for (size_t i = 0; i < means.size(); i++) {
+        if (counts[i] > 0.0) means[i] = static_cast<float>(sums[i] / counts[i]);
+      }
 
-      // write the mean out to the stdout
-      oops::Log::info() << "mean value for " << group << "/" << variable
-                        << "=" << mean << std::endl;
+      // write the means out to the stdout
+      for (size_t g = 0; g < groups.size(); g++) {
+        for (size_t var = 0; var < variables.size(); var++) {
+          const size_t first = (g * variables.size() + var) * nchans;
+          oops::Log::info() << "mean value for " << groups[g] << "/" << variables[var] << "="
+                            << std::vector<float>(means.begin() + first,
+                                                  means.begin() + first + nchans) << std::endl;
+          // one line per channel for the comparison with a test reference
+          for (size_t c = 0; c < nchans; c++) {
+            oops::Log::test() << "mean " << groups[g] << "/" << variables[var] << " channel "
+                              << (channels.empty() ? 0 : channels[c]) << " = "
+                              << means[first + c] << std::endl;
+          }
+        }
+      }
 
-      // let's try writing the mean out to a IODA file now!
+      // let's try writing the means out to a IODA file now, from one rank
       ////////////////////////////////////////////////////
+      if (getComm().rank() != 0) return 0;
       // get the configuration for the obsdataout
       eckit::LocalConfiguration outconf(fullConfig, "obsdataout");
       ioda::ObsDataOutParameters outparams;
       outparams.validateAndDeserialize(outconf);
 
-      // set up the backend
+      // set up the backend, with room for every mean and the metadata of each variable
       auto backendParams = ioda::Engines::BackendCreationParameters();
       backendParams.fileName = outconf.getString("engine.obsfile");
       backendParams.createMode = ioda::Engines::BackendCreateModes::Truncate_If_Exists;
       backendParams.action = ioda::Engines::BackendFileActions::Create;
       backendParams.flush = true;
-      backendParams.allocBytes = 1024*1024*50;  // no idea what this number should be
+      const size_t noutputs = groups.size() * variables.size() + (channelDim ? 2 : 1);
+      backendParams.allocBytes = kFileBytes + noutputs * kVariableBytes
+                                 + (means.size() + nchans) * sizeof(float);
 
       // construct the output group(s)
       ioda::Group grpFromFile
@@ -102,24 +162,35 @@ namespace dautils {
       ioda::NewDimensionScales_t newDims;
       newDims.push_back(ioda::NewDimensionScale<int>("Location",
                                                      numLocs, ioda::Unlimited, numLocs));
+      if (channelDim) {
+        newDims.push_back(ioda::NewDimensionScale<int>("Channel", nchans, nchans, nchans));
+      }
       ioda::ObsGroup og = ioda::ObsGroup::generate(grpFromFile, newDims);
 
-      // create the output variables
-      ioda::Variable LocationVar = og.vars["Location"];
-      std::string varname = "mean/" + group + "/" + variable;
+      // create the output variables, one per group/variable, over the channels in batch mode
+      std::vector<ioda::Variable> scales = {og.vars["Location"]};
+      if (channelDim) {
+        ioda::Variable channelVar = og.vars["Channel"];
+        channelVar.write(channels);
+        scales.push_back(channelVar);
+      }
       ioda::VariableCreationParameters float_params;
       float_params.chunk = true;               // allow chunking
       float_params.compressWithGZIP();         // compress using gzip
       float_params.setFillValue<float>(-999);  // set the fill value to -999
-      ioda::Variable outVar = og.vars.createWithScales<float>(varname, {LocationVar}, float_params);
-
-      // write to file
-      std::vector<float> meanVec(numLocs);
-      meanVec[0] = mean;
-      outVar.write(meanVec);
+      for (size_t g = 0; g < groups.size(); g++) {
+        for (size_t var = 0; var < variables.size(); var++) {
+          const std::string varname = "mean/" + groups[g] + "/" + variables[var];
+          ioda::Variable outVar = og.vars.createWithScales<float>(varname, scales, float_params);
+          // write to file
+          const size_t first = (g * variables.size() + var) * nchans;
+          outVar.write(std::vector<float>(means.begin() + first,
+                                          means.begin() + first + (channelDim ? nchans : 1)));
+        }
+      }
 
       // print a message
-      oops::Log::info() << "mean written to" << backendParams.fileName << std::endl;
+      oops::Log::info() << "means written to " << backendParams.fileName << std::endl;
 
       // a better program should return a real exit code depending on result,
       // but this is just an example!
@@ -131,6 +202,32 @@ namespace dautils {
       return "dautils::IodaExample";
     }
     // -----------------------------------------------------------------------------
+    // adds the valid values of every channel of buffer (nlocs x nchans, as returned
+    // by get_db) to sums and counts. The inner loop has no branch so it vectorizes
+    static void sumValues(const std::vector<float> & buffer, const size_t nchans,
+                          double * sums, double * counts) {
+      const float missing = util::missingValue<float>();
+      std::vector<double> sum(nchans, 0.0);
+      std::vector<double> count(nchans, 0.0);
+      for (size_t i = 0; i < buffer.size(); i += nchans) {
+        const float * row = buffer.data() + i;
+        for (size_t c = 0; c < nchans; c++) {
+          const bool valid = row[c] != missing;
+          sum[c] += valid ? row[c] : 0.0f;
+          count[c] += valid ? 1.0 : 0.0;
+        }
+      }
+      for (size_t c = 0; c < nchans; c++) {
+        sums[c] += sum[c];
+        counts[c] += count[c];
+      }
+    }
+    // -----------------------------------------------------------------------------
+    // HDF5 file overhead and space for the dimension scales and attributes
+    // of each variable, on top of the values themselves
+    static constexpr size_t kFileBytes = 64 * 1024;
+    static constexpr size_t kVariableBytes = 4 * 1024;
+    // -----------------------------------------------------------------------------
   };
 
 }  // namespace dautils
@@ -1,123 +1,958 @@
 #pragma once
 
+#include <mpi.h>
+
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <limits>
+#include <vector>
+
+#include "eckit/exception/Exceptions.h"
+#include "eckit/mpi/Comm.h"
+
 #include "oops/util/Logger.h"
 #include "oops/util/missingValues.h"
 
 namespace dautils {
+  // one word of a packed location mask, bit i%64 of word i/64 is set when
+  // location i is in the domain (see DomainMasks)
+  using MaskWord = uint64_t;
+  constexpr size_t kMaskWordBits = 64;
+
+  // moments the accumulation kernels have to compute, or'ed together by the
+  // statistics asked for (see StatPlan), the count is always computed
+  constexpr unsigned kNeedCount = 0;
+  constexpr unsigned kNeedSum = 1;
+  constexpr unsigned kNeedSumSq = 2;
+  constexpr unsigned kNeedMinMax = 4;
+  constexpr unsigned kNeedAll = kNeedSum | kNeedSumSq | kNeedMinMax;
+  // distribution summaries, kept outside of the kernels' moments (see Distribution)
+  constexpr unsigned kNeedQuantiles = 8;
+  constexpr unsigned kNeedHistogram = 16;
+  constexpr unsigned kNeedDistribution = kNeedQuantiles | kNeedHistogram;
+
+  // -----------------------------------------------------------------------------
+  // running state for every moment based statistic of one sample
+  // partial states (blocks, ranks, ...) are combined with merge, the variance
+  // uses the pairwise update of Chan et al. so it stays accurate for large counts
+  struct StatAccumulator {
+    int64_t count = 0;
+    double sum = 0.0;
+    double sumsq = 0.0;
+    double m2 = 0.0;  // sum of squared deviations from the mean
+    float min = std::numeric_limits<float>::max();
+    float max = std::numeric_limits<float>::lowest();
+
+    void merge(const StatAccumulator &other) {
+      if (other.count == 0) return;
+      if (count == 0) {
+        *this = other;
+        return;
+      }
+      const double na = static_cast<double>(count);
+      const double nb = static_cast<double>(other.count);
+      const double delta = other.sum / nb - sum / na;
+      m2 += other.m2 + delta * delta * na * nb / (na + nb);
+      count += other.count;
+      sum += other.sum;
+      sumsq += other.sumsq;
+      min = std::min(min, other.min);
+      max = std::max(max, other.max);
+    }
+    double mean() const { return count > 0 ? sum / static_cast<double>(count) : 0.0; }
+    double rms() const {
+      return count > 0 ? std::sqrt(sumsq / static_cast<double>(count)) : 0.0;
+    }
+    // population variance, consistent with the RMS definition above
+    double variance() const { return count > 0 ? m2 / static_cast<double>(count) : 0.0; }
+    double stddev() const { return std::sqrt(variance()); }
+  };
+
+  // -----------------------------------------------------------------------------
+  // running state of the statistics comparing two samples x and y of the same
+  // locations (two groups of a variable), merged with the co-moment update of Chan et al.
+  struct PairAccumulator {
+    int64_t count = 0;
+    double sumx = 0.0;
+    double sumy = 0.0;
+    double sumxy = 0.0;
+    double sumxx = 0.0;
+    double sumyy = 0.0;
+    double m2x = 0.0;   // sums of squared deviations from the means
+    double m2y = 0.0;
+    double cxy = 0.0;   // sum of the products of the deviations
+
+    void merge(const PairAccumulator &other) {
+      if (other.count == 0) return;
+      if (count == 0) {
+        *this = other;
+        return;
+      }
+      const double na = static_cast<double>(count);
+      const double nb = static_cast<double>(other.count);
+      const double dx = other.sumx / nb - sumx / na;
+      const double dy = other.sumy / nb - sumy / na;
+      const double weight = na * nb / (na + nb);
+      m2x += other.m2x + dx * dx * weight;
+      m2y += other.m2y + dy * dy * weight;
+      cxy += other.cxy + dx * dy * weight;
+      count += other.count;
+      sumx += other.sumx;
+      sumy += other.sumy;
+      sumxy += other.sumxy;
+      sumxx += other.sumxx;
+      sumyy += other.sumyy;
+    }
+    double covariance() const { return count > 0 ? cxy / static_cast<double>(count) : 0.0; }
+    double correlation() const {
+      return m2x > 0.0 && m2y > 0.0 ? cxy / std::sqrt(m2x * m2y) : 0.0;
+    }
+    // mean of x * y, with the O-B and O-A departures the Desroziers et al. (2005)
+    // estimate of the observation error variance
+    double crossProduct() const {
+      return count > 0 ? sumxy / static_cast<double>(count) : 0.0;
+    }
+    double meanDifference() const {
+      return count > 0 ? (sumx - sumy) / static_cast<double>(count) : 0.0;
+    }
+    double rmsRatio() const { return sumxx > 0.0 ? std::sqrt(sumyy / sumxx) : 0.0; }
+  };
+
+  // -----------------------------------------------------------------------------
+  // MPI reduction operator merging arrays of partial states, invec holds the lower ranks
+  template <typename Accumulator>
+  void mergeAccumulatorsOp(void *invec, void *inoutvec, int *len, MPI_Datatype *) {
+    const Accumulator *in = static_cast<const Accumulator *>(invec);
+    Accumulator *inout = static_cast<Accumulator *>(inoutvec);
+    for (int i = 0; i < *len; ++i) {
+      Accumulator merged = in[i];
+      merged.merge(inout[i]);
+      inout[i] = merged;
+    }
+  }
+  // -----------------------------------------------------------------------------
+  // merge the partial states (StatAccumulator or PairAccumulator) of all ranks of comm
+  // onto root with a single MPI_Reduce, the operator is declared non commutative so
+  // ranks are always combined in order
+  template <typename Accumulator>
+  void reduceAccumulators(std::vector<Accumulator> &accs,
+                          const eckit::mpi::Comm &comm, const size_t root) {
+    if (comm.size() == 1 || accs.empty()) return;
+    MPI_Comm mpiComm = MPI_Comm_f2c(comm.communicator());
+    MPI_Datatype accType;
+    MPI_Type_contiguous(sizeof(Accumulator), MPI_BYTE, &accType);
+    MPI_Type_commit(&accType);
+    MPI_Op mergeOp;
+    MPI_Op_create(&mergeAccumulatorsOp<Accumulator>, 0, &mergeOp);
+    if (comm.rank() == root) {
+      MPI_Reduce(MPI_IN_PLACE, accs.data(), accs.size(), accType, mergeOp, root, mpiComm);
+    } else {
+      MPI_Reduce(accs.data(), nullptr, accs.size(), accType, mergeOp, root, mpiComm);
+    }
+    MPI_Op_free(&mergeOp);
+    MPI_Type_free(&accType);
+  }
+  // -----------------------------------------------------------------------------
+  // merge the partial states of all ranks of comm and scatter the result with a single
+  // MPI_Reduce_scatter and the same non commutative operator: accs holds the blocks of
+  // every rank one after the other, counts[r] states for rank r, and is replaced by the
+  // merged block of this rank
+  template <typename Accumulator>
+  void reduceScatterAccumulators(std::vector<Accumulator> &accs, const std::vector<int> &counts,
+                                 const eckit::mpi::Comm &comm) {
+    if (comm.size() == 1) return;
+    MPI_Comm mpiComm = MPI_Comm_f2c(comm.communicator());
+    MPI_Datatype accType;
+    MPI_Type_contiguous(sizeof(Accumulator), MPI_BYTE, &accType);
+    MPI_Type_commit(&accType);
+    MPI_Op mergeOp;
+    MPI_Op_create(&mergeAccumulatorsOp<Accumulator>, 0, &mergeOp);
+    std::vector<Accumulator> merged(counts[comm.rank()]);
+    MPI_Reduce_scatter(accs.data(), merged.data(), counts.data(), accType, mergeOp, mpiComm);
+    MPI_Op_free(&mergeOp);
+    MPI_Type_free(&accType);
+    accs.swap(merged);
+  }
+
+  // -----------------------------------------------------------------------------
+  // KLL quantile sketch (Karnin, Lang and Liberty 2016): levels of sorted compactors,
+  // an item of level h stands for 2^h values. Memory is O(k log(n/k)) and the rank
+  // error about 1.7/k whatever the number of values, so quantiles of a domain never
+  // need a sorted copy of its data. Compaction alternates between keeping the odd
+  // and the even items instead of a coin flip so results are reproducible
+  class QuantileSketch {
+    public:
+    QuantileSketch() = default;
+    explicit QuantileSketch(const size_t k) : k_(k) {}
+
+    bool enabled() const { return k_ > 0; }
+    int64_t count() const { return count_; }
+    // bound of the rank error of the quantiles, as a fraction of count
+    double rankError() const { return k_ > 0 ? 1.7 / static_cast<double>(k_) : 0.0; }
+
+    void add(const float x) {
+      if (levels_.empty()) grow();
+      levels_[0].push_back(x);
+      ++count_;
+      if (++size_ >= maxSize_) compress();
+    }
+
+    void merge(const QuantileSketch &other) {
+      if (other.count_ == 0) return;
+      while (levels_.size() < other.levels_.size()) grow();
+      for (size_t h = 0; h < other.levels_.size(); ++h) {
+        std::vector<float> &level = levels_[h];
+        const size_t n = level.size();
+        level.insert(level.end(), other.levels_[h].begin(), other.levels_[h].end());
+        if (h > 0) std::inplace_merge(level.begin(), level.begin() + n, level.end());
+      }
+      count_ += other.count_;
+      size_ += other.size_;
+      while (size_ >= maxSize_) compress();
+    }
+
+    // empty the sketch, keeping its size
+    void clear() {
+      levels_.clear();
+      parity_.clear();
+      capacities_.clear();
+      count_ = 0;
+      size_ = 0;
+      maxSize_ = 0;
+    }
+
+    // values at the given levels in [0, 1], fillVal for an empty sketch
+    std::vector<float> quantiles(const std::vector<float> &levels, const float fillVal) const {
+      std::vector<float> values(levels.size(), fillVal);
+      if (count_ == 0) return values;
+      std::vector<std::pair<float, int64_t>> items;
+      items.reserve(size_);
+      for (size_t h = 0; h < levels_.size(); ++h) {
+        for (const float x : levels_[h]) items.push_back({x, int64_t(1) << h});
+      }
+      std::sort(items.begin(), items.end());
+      int64_t total = 0;
+      for (const auto &item : items) total += item.second;
+      for (size_t q = 0; q < levels.size(); ++q) {
+        const double target = std::min(std::max(levels[q], 0.0f), 1.0f)
+                              * static_cast<double>(total);
+        int64_t weight = 0;
+        size_t i = 0;
+        for (; i + 1 < items.size(); ++i) {
+          weight += items[i].second;
+          if (static_cast<double>(weight) >= target) break;
+        }
+        values[q] = items[i].first;
+      }
+      return values;
+    }
+
+    // flat copy for MPI, see Distribution
+    void pack(std::vector<char> &buf) const {
+      appendBytes(buf, count_);
+      appendBytes(buf, static_cast<uint64_t>(levels_.size()));
+      for (size_t h = 0; h < levels_.size(); ++h) {
+        appendBytes(buf, static_cast<uint64_t>(levels_[h].size()));
+        appendBytes(buf, static_cast<uint8_t>(parity_[h]));
+        const char *bytes = reinterpret_cast<const char *>(levels_[h].data());
+        buf.insert(buf.end(), bytes, bytes + levels_[h].size() * sizeof(float));
+      }
+    }
+    // the packed bytes are in [buf, end), unpacking past end throws
+    void unpack(const char *&buf, const char *end) {
+      uint64_t nlevels;
+      readBytes(buf, end, count_);
+      readBytes(buf, end, nlevels);
+      levels_.clear();
+      parity_.clear();
+      size_ = 0;
+      for (uint64_t h = 0; h < nlevels; ++h) {
+        uint64_t n;
+        uint8_t parity;
+        readBytes(buf, end, n);
+        readBytes(buf, end, parity);
+        checkBytes(buf, end, n, sizeof(float));
+        levels_.emplace_back(n);
+        parity_.push_back(parity);
+        std::memcpy(levels_.back().data(), buf, n * sizeof(float));
+        buf += n * sizeof(float);
+        size_ += n;
+      }
+      updateCapacities();
+    }
+
+    template <typename T>
+    static void appendBytes(std::vector<char> &buf, const T &value) {
+      const char *bytes = reinterpret_cast<const char *>(&value);
+      buf.insert(buf.end(), bytes, bytes + sizeof(T));
+    }
+    template <typename T>
+    static void readBytes(const char *&buf, const char *end, T &value) {
+      checkBytes(buf, end, 1, sizeof(T));
+      std::memcpy(&value, buf, sizeof(T));
+      buf += sizeof(T);
+    }
+    // throws unless n items of size bytes are left before end
+    static void checkBytes(const char *buf, const char *end, const uint64_t n, const size_t size) {
+      if (end < buf || n > static_cast<uint64_t>(end - buf) / size) {
+        throw eckit::Exception("QuantileSketch: truncated packed state");
+      }
+    }
+
+    private:
+    // smallest level size, below this compactions get too frequent to pay off
+    static constexpr size_t kMinCapacity = 8;
+    // levels shrink geometrically by 2/3 from the top one, which holds k items,
+    // except level 0 which also holds k items: it is the insertion buffer, sorted
+    // once every k/2 values, and exact so it does not add to the error.
+    // the capacities only change when a level is added so they are kept
+    void updateCapacities() {
+      capacities_.resize(levels_.size());
+      maxSize_ = 0;
+      for (size_t h = 0; h < levels_.size(); ++h) {
+        const double scale = std::pow(2.0 / 3.0, static_cast<double>(levels_.size() - 1 - h));
+        capacities_[h] = std::max<size_t>(h == 0 ? k_ : kMinCapacity,
+                                          static_cast<size_t>(std::ceil(
+                                              static_cast<double>(k_) * scale)));
+        maxSize_ += capacities_[h];
+      }
+    }
+    void grow() {
+      levels_.emplace_back();
+      parity_.push_back(0);
+      updateCapacities();
+    }
+    // halve the lowest full level into the one above it, levels above 0 are kept
+    // sorted so only the insertion buffer is ever sorted, the others are merged
+    void compress() {
+      for (size_t h = 0; h < levels_.size(); ++h) {
+        if (levels_[h].size() < capacities_[h]) continue;
+        if (h + 1 == levels_.size()) grow();
+        std::vector<float> &level = levels_[h];
+        std::vector<float> &above = levels_[h + 1];
+        if (h == 0) std::sort(level.begin(), level.end());
+        // an odd item out stays at this level so the total weight is unchanged
+        const bool odd = level.size() % 2 != 0;
+        const float kept = level.back();
+        const size_t n = level.size() - (odd ? 1 : 0);
+        const size_t nabove = above.size();
+        for (size_t i = parity_[h]; i < n; i += 2) above.push_back(level[i]);
+        std::inplace_merge(above.begin(), above.begin() + nabove, above.end());
+        parity_[h] ^= 1;
+        size_ -= n / 2;
+        level.clear();
+        if (odd) level.push_back(kept);
+        return;
+      }
+    }
+
+    size_t k_ = 0;
+    int64_t count_ = 0;
+    size_t size_ = 0;
+    size_t maxSize_ = 0;
+    std::vector<size_t> capacities_;
+    std::vector<std::vector<float>> levels_;
+    std::vector<uint8_t> parity_;
+  };
+
+  // -----------------------------------------------------------------------------
+  // fixed width bins over [minval, maxval], the first and last bins are open ended
+  // and also count the values below and above the range
+  class Histogram {
+    public:
+    Histogram() = default;
+    Histogram(const float minval, const float maxval, const size_t nbins)
+      : minval_(minval), scale_(static_cast<float>(nbins) / (maxval - minval)),
+        counts_(nbins, 0) {}
+
+    bool enabled() const { return !counts_.empty(); }
+    const std::vector<int64_t> &counts() const { return counts_; }
+
+    void add(const float x) {
+      const float pos = (x - minval_) * scale_;
+      const float last = static_cast<float>(counts_.size() - 1);
+      ++counts_[static_cast<size_t>(pos > 0.0f ? std::min(pos, last) : 0.0f)];
+    }
+
+    void merge(const Histogram &other) {
+      for (size_t b = 0; b < other.counts_.size(); ++b) counts_[b] += other.counts_[b];
+    }
+
+    void clear() { std::fill(counts_.begin(), counts_.end(), 0); }
+
+    void pack(std::vector<char> &buf) const {
+      const char *bytes = reinterpret_cast<const char *>(counts_.data());
+      buf.insert(buf.end(), bytes, bytes + counts_.size() * sizeof(int64_t));
+    }
+    void unpack(const char *&buf, const char *end) {
+      QuantileSketch::checkBytes(buf, end, counts_.size(), sizeof(int64_t));
+      std::memcpy(counts_.data(), buf, counts_.size() * sizeof(int64_t));
+      buf += counts_.size() * sizeof(int64_t);
+    }
+
+    private:
+    float minval_ = 0.0f;
+    float scale_ = 0.0f;
+    std::vector<int64_t> counts_;
+  };
+
+  // -----------------------------------------------------------------------------
+  // distribution summaries of one sample, either part may be disabled
+  struct Distribution {
+    QuantileSketch sketch;
+    Histogram histogram;
+
+    void add(const float x) {
+      if (sketch.enabled()) sketch.add(x);
+      if (histogram.enabled()) histogram.add(x);
+    }
+    void merge(const Distribution &other) {
+      if (sketch.enabled()) sketch.merge(other.sketch);
+      if (histogram.enabled()) histogram.merge(other.histogram);
+    }
+    void clear() {
+      sketch.clear();
+      histogram.clear();
+    }
+    void pack(std::vector<char> &buf) const {
+      if (sketch.enabled()) sketch.pack(buf);
+      if (histogram.enabled()) histogram.pack(buf);
+    }
+    void unpack(const char *&buf, const char *end) {
+      if (sketch.enabled()) sketch.unpack(buf, end);
+      if (histogram.enabled()) histogram.unpack(buf, end);
+    }
+  };
+
+  // -----------------------------------------------------------------------------
+  // merge the distributions of all ranks of comm onto root, they do not have a fixed
+  // size so they are packed and gathered, then merged on root in rank order.
+  // every rank must pass distributions configured the same way
+  inline void reduceDistributions(std::vector<Distribution> &dists,
+                                  const eckit::mpi::Comm &comm, const size_t root) {
+    if (comm.size() == 1 || dists.empty()) return;
+    MPI_Comm mpiComm = MPI_Comm_f2c(comm.communicator());
+    std::vector<char> sendbuf;
+    for (const Distribution &dist : dists) dist.pack(sendbuf);
+    const int sendsize = static_cast<int>(sendbuf.size());
+    const bool isRoot = comm.rank() == root;
+    std::vector<int> sizes(isRoot ? comm.size() : 0);
+    MPI_Gather(&sendsize, 1, MPI_INT, sizes.data(), 1, MPI_INT, static_cast<int>(root),
+               mpiComm);
+    std::vector<int> offsets(sizes.size(), 0);
+    for (size_t r = 1; r < sizes.size(); ++r) offsets[r] = offsets[r - 1] + sizes[r - 1];
+    std::vector<char> recvbuf(isRoot ? offsets.back() + sizes.back() : 0);
+    MPI_Gatherv(sendbuf.data(), sendsize, MPI_BYTE, recvbuf.data(), sizes.data(),
+                offsets.data(), MPI_BYTE, static_cast<int>(root), mpiComm);
+    if (!isRoot) return;
+    // copies giving the configuration of each distribution, unpack replaces their state
+    const std::vector<Distribution> layout(dists);
+    std::vector<Distribution> merged(dists.size());
+    for (size_t r = 0; r < sizes.size(); ++r) {
+      const char *buf = recvbuf.data() + offsets[r];
+      const char *end = buf + sizes[r];
+      for (size_t i = 0; i < dists.size(); ++i) {
+        Distribution part = layout[i];
+        part.unpack(buf, end);
+        if (r == 0) {
+          merged[i] = part;
+        } else {
+          merged[i].merge(part);
+        }
+      }
+    }
+    dists.swap(merged);
+  }
+  // -----------------------------------------------------------------------------
+  // reduceScatterAccumulators for distributions: the block of each rank is packed and
+  // sent to it with a single MPI_Alltoallv, then merged there in rank order
+  inline void reduceScatterDistributions(std::vector<Distribution> &dists,
+                                         const std::vector<int> &counts,
+                                         const eckit::mpi::Comm &comm) {
+    if (comm.size() == 1) return;
+    MPI_Comm mpiComm = MPI_Comm_f2c(comm.communicator());
+    const size_t nranks = comm.size();
+    std::vector<char> sendbuf;
+    std::vector<int> sendsizes(nranks, 0), sendoffsets(nranks, 0);
+    size_t start = 0, first = 0;
+    for (size_t r = 0; r < nranks; ++r) {
+      if (r == comm.rank()) first = start;
+      sendoffsets[r] = static_cast<int>(sendbuf.size());
+      for (int i = 0; i < counts[r]; ++i) dists[start + i].pack(sendbuf);
+      sendsizes[r] = static_cast<int>(sendbuf.size()) - sendoffsets[r];
+      start += counts[r];
+    }
+    std::vector<int> sizes(nranks), offsets(nranks, 0);
+    MPI_Alltoall(sendsizes.data(), 1, MPI_INT, sizes.data(), 1, MPI_INT, mpiComm);
+    for (size_t r = 1; r < nranks; ++r) offsets[r] = offsets[r - 1] + sizes[r - 1];
+    std::vector<char> recvbuf(offsets.back() + sizes.back());
+    MPI_Alltoallv(sendbuf.data(), sendsizes.data(), sendoffsets.data(), MPI_BYTE,
+                  recvbuf.data(), sizes.data(), offsets.data(), MPI_BYTE, mpiComm);
+    // this rank's block of dists gives the configuration of each distribution
+    const std::vector<Distribution> layout(dists.begin() + first,
+                                           dists.begin() + first + counts[comm.rank()]);
+    std::vector<Distribution> merged(layout.size());
+    for (size_t r = 0; r < nranks; ++r) {
+      const char *buf = recvbuf.data() + offsets[r];
+      const char *end = buf + sizes[r];
+      for (size_t i = 0; i < layout.size(); ++i) {
+        Distribution part = layout[i];
+        part.unpack(buf, end);
+        if (r == 0) {
+          merged[i] = part;
+        } else {
+          merged[i].merge(part);
+        }
+      }
+    }
+    dists.swap(merged);
+  }
+
+
+  // -----------------------------------------------------------------------------
+  // raw moments of the valid values scattered into cells (times the channels), merged
+  // into the accumulators of the cells touched since the previous merge. Merging after
+  // a bounded number of values, as the blocks of ObsStats, keeps the variance accurate
+  class CellScratch {
+    public:
+    CellScratch(const size_t ncells, const size_t nchans, const float fillVal)
+      : nchans_(std::max<size_t>(1, nchans)), fillVal_(fillVal),
+        cnt_(ncells * nchans_, 0.0), sum_(cnt_.size(), 0.0), sumsq_(cnt_.size(), 0.0),
+        mn_(cnt_.size(), std::numeric_limits<float>::max()),
+        mx_(cnt_.size(), std::numeric_limits<float>::lowest()),
+        touched_(ncells, 0) {}
+
+    // the valid values of one location row into cell
+    void add(const size_t cell, const float * row, const int * qcrow) {
+      const size_t first = cell * nchans_;
+      for (size_t c = 0; c < nchans_; c++) {
+        const float x = row[c];
+        if (x == fillVal_ || qcrow[c] != 0) continue;
+        cnt_[first + c] += 1.0;
+        sum_[first + c] += x;
+        sumsq_[first + c] += static_cast<double>(x) * x;
+        mn_[first + c] = std::min(mn_[first + c], x);
+        mx_[first + c] = std::max(mx_[first + c], x);
+      }
+      if (touched_[cell] == 0) {
+        touched_[cell] = 1;
+        touchedCells_.push_back(cell);
+      }
+    }
+
+    // merge the touched cells into accs (ncells x nchans) and clear them
+    void merge(StatAccumulator * accs) {
+      for (const size_t cell : touchedCells_) {
+        for (size_t k = cell * nchans_; k < (cell + 1) * nchans_; k++) {
+          StatAccumulator block;
+          block.count = static_cast<int64_t>(cnt_[k]);
+          block.sum = sum_[k];
+          block.sumsq = sumsq_[k];
+          block.min = mn_[k];
+          block.max = mx_[k];
+          if (block.count > 0) block.m2 = std::max(0.0, sumsq_[k] - sum_[k] * sum_[k] / cnt_[k]);
+          accs[k].merge(block);
+          cnt_[k] = sum_[k] = sumsq_[k] = 0.0;
+          mn_[k] = std::numeric_limits<float>::max();
+          mx_[k] = std::numeric_limits<float>::lowest();
+        }
+        touched_[cell] = 0;
+      }
+      touchedCells_.clear();
+    }
+
+    private:
+    const size_t nchans_;
+    const float fillVal_;
+    std::vector<double> cnt_, sum_, sumsq_;
+    std::vector<float> mn_, mx_;
+    std::vector<uint8_t> touched_;
+    std::vector<size_t> touchedCells_;
+  };
+
   class ObsStats {
     public:
     float fillVal_ = util::missingValue<float>();
-    std::vector<int> getObsCount(const std::vector<float> &data,
-                                 const std::vector<int> &qcvals,
-                                 const std::vector<int> &channels,
-                                 const std::vector<int> &mask) {
-      std::vector<int> counts;
-      if (channels.empty()) {
-        int count(0);
-        for (size_t i = 0; i < data.size(); ++i) {
-          if (data[i] != fillVal_ && qcvals[i] == 0 && mask[i] == 0) {
-            count += 1;
+    // number of locations reduced at once before being merged into the running state,
+    // a multiple of kMaskWordBits so blocks start on a mask word
+    static constexpr size_t kBlockSize = 4096;
+    // independent partial sums per block, one per location of a mask word,
+    // lets the compiler vectorize the inner loop
+    static constexpr size_t kLanes = kMaskWordBits;
+    // locations of the fixed chunks accumulateDomains hands out to threads, in values
+    static constexpr size_t kChunkValues = 16 * kBlockSize;
+    // -----------------------------------------------------------------------------
+    // compute count, sum, sum of squares, min, max and variance in one pass,
+    // moments not in needs are left at their initial value. The valid values are
+    // also added to dist, when given, block by block while they are in cache
+    StatAccumulator accumulate(const std::vector<float> &data,
+                               const std::vector<int> &qcvals,
+                               const MaskWord *mask,
+                               const unsigned needs = kNeedAll,
+                               Distribution *dist = nullptr) const {
+      StatAccumulator acc;
+      accumulateRange(data.data(), qcvals.data(), mask, 0, 0, data.size(), needs, &acc, dist);
+      return acc;
+    }
+    // -----------------------------------------------------------------------------
+    // per channel version of the above for the interleaved nlocs x nchans buffer
+    // returned by ObsSpace::get_db with a channel list, mask is per location and
+    // dists, when given, points to one distribution per channel
+    std::vector<StatAccumulator> accumulateChannels(const std::vector<float> &data,
+                                                    const std::vector<int> &qcvals,
+                                                    const MaskWord *mask,
+                                                    const size_t nchans,
+                                                    const unsigned needs = kNeedAll,
+                                                    Distribution *dists = nullptr) const {
+      std::vector<StatAccumulator> accs(nchans);
+      if (nchans == 0) return accs;
+      accumulateRange(data.data(), qcvals.data(), mask, nchans, 0, data.size() / nchans, needs,
+                      accs.data(), dists);
+      return accs;
+    }
+    // -----------------------------------------------------------------------------
+    // statistics of one variable over every domain of masks, merged into accs (and
+    // dists when given), max(1, nchans) per domain one domain after the other;
+    // nchans is 0 for a variable without channels.
+    // The locations are cut in chunks of about kChunkValues values, shared among
+    // the OpenMP threads, each reducing its chunk over every domain into private
+    // accumulators while the chunk is in cache. Chunks are merged in order, so the
+    // result does not depend on the number of threads.
+    // With bins (one per location, -1 outside of them) the valid values are also added
+    // to binAccs, laid out domain, bin then channel, in the same pass over each chunk
+    void accumulateDomains(const std::vector<float> &data,
+                           const std::vector<int> &qcvals,
+                           const std::vector<const MaskWord *> &masks,
+                           const size_t nchans,
+                           const unsigned needs,
+                           StatAccumulator *accs,
+                           Distribution *dists = nullptr,
+                           const int32_t *bins = nullptr,
+                           const size_t nbins = 0,
+                           StatAccumulator *binAccs = nullptr) const {
+      const size_t width = std::max<size_t>(1, nchans);
+      const size_t nslots = masks.size() * width;
+      const size_t nlocs = data.size() / width;
+      const size_t chunk = chunkLocations(nchans);
+      const int64_t nchunks = (nlocs + chunk - 1) / chunk;
+#pragma omp parallel if (nchunks > 1)
+      {
+        std::vector<StatAccumulator> local(nslots);
+        std::vector<Distribution> localDists(dists, dists + (dists != nullptr ? nslots : 0));
+        CellScratch localBins(bins != nullptr ? masks.size() * nbins : 0, nchans, fillVal_);
+#pragma omp for ordered schedule(dynamic, 1)
+        for (int64_t k = 0; k < nchunks; ++k) {
+          const size_t begin = k * chunk;
+          const size_t end = std::min(nlocs, begin + chunk);
+          std::fill(local.begin(), local.end(), StatAccumulator());
+          for (Distribution &dist : localDists) dist.clear();
+          for (size_t idom = 0; idom < masks.size(); ++idom) {
+            accumulateRange(data.data(), qcvals.data(), masks[idom], nchans, begin, end, needs,
+                            &local[idom * width],
+                            dists != nullptr ? &localDists[idom * width] : nullptr);
+          }
+          if (bins != nullptr) {
+            for (size_t i = begin; i < end; ++i) {
+              if (bins[i] < 0) continue;
+              const size_t word = i / kMaskWordBits;
+              const size_t bit = i % kMaskWordBits;
+              for (size_t idom = 0; idom < masks.size(); ++idom) {
+                if (((masks[idom][word] >> bit) & 1) == 0) continue;
+                localBins.add(idom * nbins + static_cast<size_t>(bins[i]),
+                              data.data() + i * width, qcvals.data() + i * width);
+              }
+            }
+          }
+#pragma omp ordered
+          {
+            for (size_t i = 0; i < nslots; ++i) {
+              accs[i].merge(local[i]);
+              if (dists != nullptr) dists[i].merge(localDists[i]);
+            }
+            if (bins != nullptr) localBins.merge(binAccs);
           }
         }
-        counts.push_back(count);
-      } else {
-        for (int ch = 0; ch < channels.size(); ch++) {
-          oops::Log::info() << ch << std::endl;
+      }
+    }
+    // -----------------------------------------------------------------------------
+    // paired statistics of two groups x and y of one variable over every domain of
+    // masks, laid out as in accumulateDomains. A value counts when it is valid in both
+    // groups (joint QC). Chunked and threaded as accumulateDomains, with the same
+    // reproducibility
+    void accumulatePairs(const std::vector<float> &xdata, const std::vector<int> &xqc,
+                         const std::vector<float> &ydata, const std::vector<int> &yqc,
+                         const std::vector<const MaskWord *> &masks,
+                         const size_t nchans,
+                         PairAccumulator *accs) const {
+      const size_t width = std::max<size_t>(1, nchans);
+      const size_t nslots = masks.size() * width;
+      const size_t nlocs = xdata.size() / width;
+      const size_t chunk = chunkLocations(nchans);
+      const int64_t nchunks = (nlocs + chunk - 1) / chunk;
+#pragma omp parallel if (nchunks > 1)
+      {
+        std::vector<PairAccumulator> local(nslots);
+        std::vector<PairAccumulator> block(width);
+#pragma omp for ordered schedule(dynamic, 1)
+        for (int64_t k = 0; k < nchunks; ++k) {
+          const size_t begin = k * chunk;
+          const size_t end = std::min(nlocs, begin + chunk);
+          std::fill(local.begin(), local.end(), PairAccumulator());
+          for (size_t idom = 0; idom < masks.size(); ++idom) {
+            accumulatePairRange(xdata.data(), xqc.data(), ydata.data(), yqc.data(), masks[idom],
+                                width, begin, end, block.data(), &local[idom * width]);
+          }
+#pragma omp ordered
+          {
+            for (size_t i = 0; i < nslots; ++i) accs[i].merge(local[i]);
+          }
         }
       }
-      return counts;
     }
     // -----------------------------------------------------------------------------
-    std::vector<float> getMean(const std::vector<float> &data,
-                               const std::vector<int> &qcvals,
-                               const std::vector<int> &channels,
-                               const std::vector<int> &mask) {
-      std::vector<float> means;
-      if (channels.empty()) {
-        int count(0);
-        float mean(0.0);
-        float sum(0.0);
-        for (size_t i = 0; i < data.size(); ++i) {
-          if (data[i] != fillVal_ && qcvals[i] == 0 && mask[i] == 0) {
-            count += 1;
-            sum += data[i];
+
+    private:
+    // expand the 64 bits of a mask word into 64 bytes of 0 or 1, 8 bits at a time
+    static void unpackMaskWord(const MaskWord word, uint8_t *bytes) {
+      static const std::array<uint64_t, 256> table = [] {
+        std::array<uint64_t, 256> t{};
+        for (size_t v = 0; v < 256; ++v) {
+          for (size_t b = 0; b < 8; ++b) {
+            t[v] |= static_cast<uint64_t>((v >> b) & 1) << (8 * b);
           }
         }
-        if (count > 0) {
-          mean = sum / count;
+        return t;
+      }();
+      for (size_t k = 0; k < sizeof(MaskWord); ++k) {
+        std::memcpy(bytes + 8 * k, &table[(word >> (8 * k)) & 0xff], 8);
+      }
+    }
+    // -----------------------------------------------------------------------------
+    // locations per chunk of accumulateDomains, a whole number of kernel blocks
+    static size_t chunkLocations(const size_t nchans) {
+      if (nchans == 0) return kChunkValues;
+      const size_t blockLocs = std::max<size_t>(1, kBlockSize / nchans);
+      return std::max<size_t>(1, kChunkValues / nchans / blockLocs) * blockLocs;
+    }
+    // -----------------------------------------------------------------------------
+    // merge the paired statistics of locations [begin, end) into accs[0:width], the
+    // sums of each block of about kBlockSize values are gathered in block first
+    void accumulatePairRange(const float *x, const int *xqc, const float *y, const int *yqc,
+                             const MaskWord *mask, const size_t width, const size_t begin,
+                             const size_t stop, PairAccumulator *block,
+                             PairAccumulator *accs) const {
+      const size_t blockLocs = std::max<size_t>(1, kBlockSize / width);
+      for (size_t start = begin; start < stop; start += blockLocs) {
+        const size_t end = std::min(stop, start + blockLocs);
+        std::fill(block, block + width, PairAccumulator());
+        for (size_t i = start; i < end; ++i) {
+          if (((mask[i / kMaskWordBits] >> (i % kMaskWordBits)) & 1) == 0) continue;
+          for (size_t c = 0; c < width; ++c) {
+            const size_t j = i * width + c;
+            const bool valid = (x[j] != fillVal_) & (y[j] != fillVal_) & (xqc[j] == 0)
+                               & (yqc[j] == 0);
+            const double xv = valid ? static_cast<double>(x[j]) : 0.0;
+            const double yv = valid ? static_cast<double>(y[j]) : 0.0;
+            block[c].count += valid ? 1 : 0;
+            block[c].sumx += xv;
+            block[c].sumy += yv;
+            block[c].sumxy += xv * yv;
+            block[c].sumxx += xv * xv;
+            block[c].sumyy += yv * yv;
+          }
+        }
+        for (size_t c = 0; c < width; ++c) {
+          PairAccumulator &b = block[c];
+          if (b.count > 0) {
+            const double n = static_cast<double>(b.count);
+            b.m2x = std::max(0.0, b.sumxx - b.sumx * b.sumx / n);
+            b.m2y = std::max(0.0, b.sumyy - b.sumy * b.sumy / n);
+            b.cxy = b.sumxy - b.sumx * b.sumy / n;
+          }
+          accs[c].merge(b);
         }
-        means.push_back(mean);
+      }
+    }
+    // -----------------------------------------------------------------------------
+    // merge the statistics of locations [begin, end) into acc, or accs[0:nchans]
+    // with channels, begin is a multiple of kMaskWordBits without channels
+    void accumulateRange(const float *data, const int *qcvals, const MaskWord *mask,
+                         const size_t nchans, const size_t begin, const size_t end,
+                         const unsigned needs, StatAccumulator *accs,
+                         Distribution *dists) const {
+      switch (needs & kNeedAll) {
+        case 0: return accumulateRange<0>(data, qcvals, mask, nchans, begin, end, accs, dists);
+        case 1: return accumulateRange<1>(data, qcvals, mask, nchans, begin, end, accs, dists);
+        case 2: return accumulateRange<2>(data, qcvals, mask, nchans, begin, end, accs, dists);
+        case 3: return accumulateRange<3>(data, qcvals, mask, nchans, begin, end, accs, dists);
+        case 4: return accumulateRange<4>(data, qcvals, mask, nchans, begin, end, accs, dists);
+        case 5: return accumulateRange<5>(data, qcvals, mask, nchans, begin, end, accs, dists);
+        case 6: return accumulateRange<6>(data, qcvals, mask, nchans, begin, end, accs, dists);
+        default:
+          return accumulateRange<kNeedAll>(data, qcvals, mask, nchans, begin, end, accs, dists);
+      }
+    }
+    template <unsigned Needs>
+    void accumulateRange(const float *data, const int *qcvals, const MaskWord *mask,
+                         const size_t nchans, const size_t begin, const size_t end,
+                         StatAccumulator *accs, Distribution *dists) const {
+      if (nchans == 0) {
+        accumulateMoments<Needs>(data, qcvals, mask, begin, end, *accs, dists);
       } else {
-        for (int ch = 0; ch < channels.size(); ch++) {
-          oops::Log::info() << ch << std::endl;
+        accumulateChannelMoments<Needs>(data, qcvals, mask, nchans, begin, end, accs, dists);
+      }
+    }
+    // -----------------------------------------------------------------------------
+    template <unsigned Needs>
+    void accumulateMoments(const float *data, const int *qcvals, const MaskWord *mask,
+                           const size_t begin, const size_t stop, StatAccumulator &acc,
+                           Distribution *dist) const {
+      for (size_t start = begin; start < stop; start += kBlockSize) {
+        const size_t end = std::min(stop, start + kBlockSize);
+        acc.merge(accumulateBlock<Needs>(data, qcvals, mask, start, end));
+        if (dist != nullptr) {
+          for (size_t first = start; first < end; first += kMaskWordBits) {
+            const MaskWord word = mask[first / kMaskWordBits];
+            if (word == 0) continue;
+            const size_t last = std::min(end, first + kMaskWordBits);
+            for (size_t i = first; i < last; ++i) {
+              if (data[i] != fillVal_ && qcvals[i] == 0 && ((word >> (i - first)) & 1) != 0) {
+                dist->add(data[i]);
+              }
+            }
+          }
         }
       }
-    //   if (channels.empty()) {
-    //     int count(0);
-    //     for (size_t i = 0; i < data.size(); ++i) {
-    //       if (data[i] != fillVal_ && qcvals[i] == 0) {
-    //         count += 1;
-    //       }
-    //     }
-    //     counts.push_back(count);
-    //   } else {
-    //     for (int ch = 0; ch < channels.size(); ch++) {
-    //       oops::Log::info() << ch << std::endl;
-    //     }
-    //   }
-      return means;
     }
     // -----------------------------------------------------------------------------
-    std::vector<float> getRMS(const std::vector<float> &data,
-                               const std::vector<int> &qcvals,
-                               const std::vector<int> &channels,
-                               const std::vector<int> &mask) {
-      std::vector<float> rmsvals;
-      if (channels.empty()) {
-        int count(0);
-        float rms(0.0);
-        float sum(0.0);
-        for (size_t i = 0; i < data.size(); ++i) {
-          if (data[i] != fillVal_ && qcvals[i] == 0 && mask[i] == 0) {
-            count += 1;
-            sum += pow(data[i], 2);
+    template <unsigned Needs>
+    void accumulateChannelMoments(const float *data, const int *qcvals, const MaskWord *mask,
+                                  const size_t nchans, const size_t begin, const size_t stop,
+                                  StatAccumulator *accs, Distribution *dists) const {
+      // keep roughly kBlockSize values per block whatever the number of channels
+      const size_t blockLocs = std::max<size_t>(1, kBlockSize / nchans);
+      std::vector<double> cnt(nchans), sum(nchans), sumsq(nchans);
+      std::vector<float> mn(nchans), mx(nchans);
+      for (size_t start = begin; start < stop; start += blockLocs) {
+        const size_t end = std::min(stop, start + blockLocs);
+        std::fill(cnt.begin(), cnt.end(), 0.0);
+        std::fill(sum.begin(), sum.end(), 0.0);
+        std::fill(sumsq.begin(), sumsq.end(), 0.0);
+        std::fill(mn.begin(), mn.end(), std::numeric_limits<float>::max());
+        std::fill(mx.begin(), mx.end(), std::numeric_limits<float>::lowest());
+        for (size_t i = start; i < end; ++i) {
+          if (((mask[i / kMaskWordBits] >> (i % kMaskWordBits)) & 1) == 0) continue;
+          const float *row = data + i * nchans;
+          const int *qcrow = qcvals + i * nchans;
+          // contiguous loop over the channels of one location
+          for (size_t c = 0; c < nchans; ++c) {
+            const float x = row[c];
+            const bool valid = (x != fillVal_) & (qcrow[c] == 0);
+            [[maybe_unused]] const double xv = valid ? static_cast<double>(x) : 0.0;
+            cnt[c] += valid ? 1.0 : 0.0;
+            if constexpr ((Needs & kNeedSum) != 0) sum[c] += xv;
+            if constexpr ((Needs & kNeedSumSq) != 0) sumsq[c] += xv * xv;
+            if constexpr ((Needs & kNeedMinMax) != 0) {
+              const float lo = valid ? x : mn[c];
+              const float hi = valid ? x : mx[c];
+              mn[c] = lo < mn[c] ? lo : mn[c];
+              mx[c] = hi > mx[c] ? hi : mx[c];
+            }
           }
         }
-        if (count > 0) {
-          rms = sqrt(sum / count);
+        for (size_t c = 0; c < nchans; ++c) {
+          StatAccumulator block;
+          block.count = static_cast<int64_t>(cnt[c]);
+          block.sum = sum[c];
+          block.sumsq = sumsq[c];
+          block.min = mn[c];
+          block.max = mx[c];
+          if ((Needs & kNeedSum) != 0 && (Needs & kNeedSumSq) != 0 && block.count > 0) {
+            block.m2 = std::max(0.0, sumsq[c] - sum[c] * sum[c] / cnt[c]);
+          }
+          accs[c].merge(block);
         }
-        rmsvals.push_back(rms);
-      } else {
-        for (int ch = 0; ch < channels.size(); ch++) {
-          oops::Log::info() << ch << std::endl;
+        if (dists != nullptr) {
+          for (size_t i = start; i < end; ++i) {
+            if (((mask[i / kMaskWordBits] >> (i % kMaskWordBits)) & 1) == 0) continue;
+            const float *row = data + i * nchans;
+            const int *qcrow = qcvals + i * nchans;
+            for (size_t c = 0; c < nchans; ++c) {
+              if (row[c] != fillVal_ && qcrow[c] == 0) dists[c].add(row[c]);
+            }
+          }
         }
       }
-    //   if (channels.empty()) {
-    //     int count(0);
-    //     for (size_t i = 0; i < data.size(); ++i) {
-    //       if (data[i] != fillVal_ && qcvals[i] == 0) {
-    //         count += 1;
-    //       }
-    //     }
-    //     counts.push_back(count);
-    //   } else {
-    //     for (int ch = 0; ch < channels.size(); ch++) {
-    //       oops::Log::info() << ch << std::endl;
-    //     }
-    //   }
-      return rmsvals;
     }
     // -----------------------------------------------------------------------------
-    // update mask provided values and a min/max value to mask outside of
-    std::vector<int> update_mask(std::vector<float> maskvalues, float minval, float maxval, const std::vector<int>& inputMask) {
-      std::vector<int> updatedMask = inputMask;
-      for (int i = 0; i < maskvalues.size(); i++) {
-        if (maskvalues[i] < minval || maskvalues[i] > maxval) {
-          updatedMask[i] = 1;
+    // branch free reduction of data[begin:end], valid values are selected rather than
+    // skipped so every lane does the same work, mask words with no location in the
+    // domain are skipped as a whole, moments not in Needs are not computed
+    template <unsigned Needs>
+    StatAccumulator accumulateBlock(const float *data, const int *qcvals, const MaskWord *mask,
+                                    const size_t begin, const size_t end) const {
+      double cnt[kLanes] = {};
+      double sum[kLanes] = {};
+      double sumsq[kLanes] = {};
+      float mn[kLanes];
+      float mx[kLanes];
+      std::fill(mn, mn + kLanes, std::numeric_limits<float>::max());
+      std::fill(mx, mx + kLanes, std::numeric_limits<float>::lowest());
+      for (size_t first = begin; first < end; first += kMaskWordBits) {
+        const MaskWord word = mask[first / kMaskWordBits];
+        if (word == 0) continue;
+        if (first + kMaskWordBits <= end) {
+          // one byte per location, cheaper to select on in the lanes than the bits
+          uint8_t inDomain[kMaskWordBits];
+          unpackMaskWord(word, inDomain);
+          const float *x = data + first;
+          const int *qc = qcvals + first;
+          for (size_t l = 0; l < kLanes; ++l) {
+            const bool valid = (x[l] != fillVal_) & (qc[l] == 0) & (inDomain[l] != 0);
+            [[maybe_unused]] const double xv = valid ? static_cast<double>(x[l]) : 0.0;
+            cnt[l] += valid ? 1.0 : 0.0;
+            if constexpr ((Needs & kNeedSum) != 0) sum[l] += xv;
+            if constexpr ((Needs & kNeedSumSq) != 0) sumsq[l] += xv * xv;
+            if constexpr ((Needs & kNeedMinMax) != 0) {
+              const float lo = valid ? x[l] : mn[l];
+              const float hi = valid ? x[l] : mx[l];
+              mn[l] = lo < mn[l] ? lo : mn[l];
+              mx[l] = hi > mx[l] ? hi : mx[l];
+            }
+          }
+        } else {
+          // the partial last word, with the same moments as the lanes above
+          for (size_t i = first; i < end; ++i) {
+            const float x = data[i];
+            if (x != fillVal_ && qcvals[i] == 0 && ((word >> (i - first)) & 1) != 0) {
+              cnt[0] += 1.0;
+              if constexpr ((Needs & kNeedSum) != 0) sum[0] += x;
+              if constexpr ((Needs & kNeedSumSq) != 0) sumsq[0] += static_cast<double>(x) * x;
+              if constexpr ((Needs & kNeedMinMax) != 0) {
+                mn[0] = std::min(mn[0], x);
+                mx[0] = std::max(mx[0], x);
+              }
+            }
+          }
         }
       }
-      return updatedMask;
+      StatAccumulator acc;
+      double n = 0.0;
+      for (size_t l = 0; l < kLanes; ++l) {
+        n += cnt[l];
+        acc.sum += sum[l];
+        acc.sumsq += sumsq[l];
+        acc.min = std::min(acc.min, mn[l]);
+        acc.max = std::max(acc.max, mx[l]);
+      }
+      acc.count = static_cast<int64_t>(n);
+      if ((Needs & kNeedSum) != 0 && (Needs & kNeedSumSq) != 0 && acc.count > 0) {
+        acc.m2 = std::max(0.0, acc.sumsq - acc.sum * acc.sum / n);
+      }
+      return acc;
     }
-    // -----------------------------------------------------------------------------
   };
 }  // namespace dautils
@@ -0,0 +1,238 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <map>
+#include <sstream>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "eckit/config/LocalConfiguration.h"
+#include "eckit/exception/Exceptions.h"
+
+#include "oops/util/Logger.h"
+
+#include "common/iodareader.h"
+
+#include "./calcstats.h"
+#include "./readplan.h"
+#include "./regions.h"
+
+namespace dautils {
+  // -----------------------------------------------------------------------------
+  // a location is kept when minval <= MetaData/variable <= maxval
+  struct MaskRange {
+    std::string variable;
+    float minval;
+    float maxval;
+  };
+
+  // -----------------------------------------------------------------------------
+  // a named domain, the intersection of any number of range conditions and
+  // optionally of a region (ocean basin or polygon) of the RegionRaster
+  struct Domain {
+    std::string name;
+    std::vector<MaskRange> ranges;
+    std::string region;
+
+    // reads the "domain" entry of "domains to process", conditions are given as a
+    // "mask ranges" list and/or the older first/second/third mask variable keys
+    explicit Domain(const eckit::Configuration & domainConf) {
+      domainConf.get("name", name);
+      if (domainConf.has("region")) {
+        domainConf.get("region", region);
+      }
+      std::vector<eckit::LocalConfiguration> rangeConfs;
+      if (domainConf.has("mask ranges")) {
+        domainConf.get("mask ranges", rangeConfs);
+      }
+      for (const auto & rangeConf : rangeConfs) {
+        std::string variable;
+        std::vector<float> range;
+        rangeConf.get("variable", variable);
+        rangeConf.get("range", range);
+        addRange(variable, range);
+      }
+      for (const std::string prefix : {"first", "second", "third"}) {
+        if (domainConf.has(prefix + " mask variable")) {
+          std::string variable;
+          std::vector<float> range;
+          domainConf.get(prefix + " mask variable", variable);
+          domainConf.get(prefix + " mask range", range);
+          addRange(variable, range);
+        }
+      }
+    }
+
+    void addRange(const std::string & variable, const std::vector<float> & range) {
+      if (range.size() != 2) {
+        throw eckit::BadValue("Domain " + name + ": range of " + variable
+                              + " needs a min and a max value");
+      }
+      ranges.push_back({variable, range[0], range[1]});
+    }
+
+    // conditions as text for the log
+    std::string describe() const {
+      std::ostringstream os;
+      for (const MaskRange & range : ranges) {
+        os << range.variable << "=[" << range.minval << ", " << range.maxval << "];";
+      }
+      if (!region.empty()) os << "region=" << region << ";";
+      return os.str();
+    }
+  };
+
+  // -----------------------------------------------------------------------------
+  // packed masks of all domains of an obs space, nlocs/8 bytes per domain
+  class DomainMasks {
+    public:
+    DomainMasks(const size_t ndomains, const size_t nlocs)
+      : ndomains_(ndomains), nlocs_(nlocs), nwords_((nlocs + kMaskWordBits - 1) / kMaskWordBits),
+        bits_(ndomains * nwords_, ~MaskWord(0)) {
+      // locations past nlocs in the last word are never in a domain
+      const size_t tail = nlocs % kMaskWordBits;
+      if (tail != 0) {
+        for (size_t idom = 0; idom < ndomains; idom++) {
+          bits_[idom * nwords_ + nwords_ - 1] = (MaskWord(1) << tail) - 1;
+        }
+      }
+    }
+
+    const MaskWord * domain(const size_t idom) const { return bits_.data() + idom * nwords_; }
+    size_t nwords() const { return nwords_; }
+    // the masks of every domain, in order
+    std::vector<const MaskWord *> domains() const {
+      std::vector<const MaskWord *> masks;
+      for (size_t idom = 0; idom < ndomains_; idom++) masks.push_back(domain(idom));
+      return masks;
+    }
+
+    // number of locations in a domain
+    size_t count(const size_t idom) const {
+      size_t n = 0;
+      for (size_t w = 0; w < nwords_; w++) n += __builtin_popcountll(domain(idom)[w]);
+      return n;
+    }
+
+    // clear the locations outside of the range of every (domain, range) pair,
+    // all ranges on the same variable are applied in one pass over its values
+    void applyRanges(const std::vector<float> & values,
+                     const std::vector<std::pair<size_t, MaskRange>> & ranges) {
+      for (size_t w = 0; w < nwords_; w++) {
+        const size_t first = w * kMaskWordBits;
+        const size_t nbits = std::min(kMaskWordBits, nlocs_ - first);
+        const float * vals = values.data() + first;
+        for (const auto & item : ranges) {
+          const float minval = item.second.minval;
+          const float maxval = item.second.maxval;
+          MaskWord inside = 0;
+          for (size_t b = 0; b < nbits; b++) {
+            inside |= MaskWord((vals[b] >= minval) & (vals[b] <= maxval)) << b;
+          }
+          bits_[item.first * nwords_ + w] &= inside;
+        }
+      }
+    }
+
+    // clear the locations outside of the region of every (domain, region bit) pair,
+    // the raster is looked up once per location whatever the number of domains
+    void applyRegions(const std::vector<float> & lats, const std::vector<float> & lons,
+                      const RegionRaster & raster,
+                      const std::vector<std::pair<size_t, size_t>> & regions) {
+      RegionRaster::Cell cells[kMaskWordBits];
+      for (size_t w = 0; w < nwords_; w++) {
+        const size_t first = w * kMaskWordBits;
+        const size_t nbits = std::min(kMaskWordBits, nlocs_ - first);
+        for (size_t b = 0; b < nbits; b++) {
+          cells[b] = raster.lookup(lats[first + b], lons[first + b]);
+        }
+        for (const auto & item : regions) {
+          MaskWord inside = 0;
+          for (size_t b = 0; b < nbits; b++) {
+            inside |= MaskWord((cells[b] >> item.second) & 1) << b;
+          }
+          bits_[item.first * nwords_ + w] &= inside;
+        }
+      }
+    }
+
+    private:
+    size_t ndomains_;
+    size_t nlocs_;
+    size_t nwords_;
+    std::vector<MaskWord> bits_;
+  };
+
+  // -----------------------------------------------------------------------------
+  // the MetaData of every range condition by variable, and the (domain, region bit)
+  // pairs of the domains restricted to a region
+  inline void groupConditions(
+      const std::vector<Domain> & domains, const RegionRaster & regions,
+      std::map<std::string, std::vector<std::pair<size_t, MaskRange>>> & byVariable,
+      std::vector<std::pair<size_t, size_t>> & byRegion) {
+    for (size_t idom = 0; idom < domains.size(); idom++) {
+      for (const MaskRange & range : domains[idom].ranges) {
+        byVariable[range.variable].push_back({idom, range});
+      }
+      if (!domains[idom].region.empty()) {
+        const int bit = regions.regionIndex(domains[idom].region);
+        if (bit < 0) {
+          throw eckit::BadValue("Domain " + domains[idom].name + ": region "
+                                + domains[idom].region + " is not defined in regions");
+        }
+        byRegion.push_back({idom, static_cast<size_t>(bit)});
+      }
+    }
+  }
+
+  // the MetaData arrays computeDomainMasks reads, each MetaData variable of the range
+  // conditions once and latitude and longitude once for the regions
+  inline void planDomainMasks(ReadPlan & plan, const std::vector<Domain> & domains,
+                              const RegionRaster & regions = RegionRaster()) {
+    std::map<std::string, std::vector<std::pair<size_t, MaskRange>>> byVariable;
+    std::vector<std::pair<size_t, size_t>> byRegion;
+    groupConditions(domains, regions, byVariable, byRegion);
+    for (const auto & item : byVariable) plan.addMetaData(item.first);
+    if (!byRegion.empty()) {
+      plan.addMetaData("latitude");
+      plan.addMetaData("longitude");
+    }
+  }
+
+  // -----------------------------------------------------------------------------
+  // masks of all domains followed by the global domain, from the MetaData of the
+  // current block of cache, planned with planDomainMasks
+  inline DomainMasks computeDomainMasks(ArrayCache & cache, const size_t nlocs,
+                                        const std::vector<Domain> & domains,
+                                        const RegionRaster & regions = RegionRaster()) {
+    DomainMasks masks(domains.size() + 1, nlocs);
+    std::map<std::string, std::vector<std::pair<size_t, MaskRange>>> byVariable;
+    std::vector<std::pair<size_t, size_t>> byRegion;
+    groupConditions(domains, regions, byVariable, byRegion);
+    for (const auto & item : byVariable) {
+      const size_t id = cache.plan().metaData(item.first);
+      masks.applyRanges(cache.floats(id), item.second);
+      cache.release(id);
+    }
+    if (!byRegion.empty()) {
+      const size_t latId = cache.plan().metaData("latitude");
+      const size_t lonId = cache.plan().metaData("longitude");
+      masks.applyRegions(cache.floats(latId), cache.floats(lonId), regions, byRegion);
+      cache.release(latId);
+      cache.release(lonId);
+    }
+    return masks;
+  }
+
+  // the same from the current block of ospace on its own
+  inline DomainMasks computeDomainMasks(const ObsSource & ospace,
+                                        const std::vector<Domain> & domains,
+                                        const RegionRaster & regions = RegionRaster()) {
+    ReadPlan plan;
+    planDomainMasks(plan, domains, regions);
+    ArrayCache cache(plan, ospace, {});
+    return computeDomainMasks(cache, ospace.nlocs(), domains, regions);
+  }
+}  // namespace dautils
@@ -0,0 +1,214 @@
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <limits>
+#include <string>
+#include <vector>
+
+#include "eckit/config/LocalConfiguration.h"
+#include "eckit/exception/Exceptions.h"
+
+#include "oops/util/Duration.h"
+#include "oops/util/TimeWindow.h"
+
+#include "./calcstats.h"
+#include "./readplan.h"
+
+namespace dautils {
+  // -----------------------------------------------------------------------------
+  // regular bins of a MetaData variable over [min, max), "bin size" wide, the bin of
+  // a value is found with arithmetic only, no search
+  struct BinAxis {
+    std::string dimension;        // Latitude, Longitude or Level
+    std::string coordinateName;   // bin centers in the output file
+    std::string variable;         // MetaData variable
+    float minval = 0.0f;
+    float binSize = 1.0f;
+    size_t nbins = 0;
+    bool periodic = false;        // longitudes one turn off are wrapped into [min, min + 360)
+
+    BinAxis() = default;
+    BinAxis(const eckit::Configuration & conf, const std::string & dim,
+            const std::string & coordinate, const std::string & defaultVariable)
+      : dimension(dim), coordinateName(coordinate), variable(defaultVariable) {
+      if (conf.has("variable")) {
+        conf.get("variable", variable);
+      }
+      float maxval;
+      conf.get("min", minval);
+      conf.get("max", maxval);
+      conf.get("bin size", binSize);
+      if (!(binSize > 0.0f) || !(maxval > minval)) {
+        throw eckit::BadValue(dimension + " bins need min < max and a positive bin size");
+      }
+      nbins = static_cast<size_t>(std::ceil((maxval - minval) / binSize));
+      periodic = dimension == "Longitude" && maxval - minval >= 360.0f;
+    }
+
+    // bin of x, -1 outside of the bins (missing values included)
+    int64_t index(float x) const {
+      if (periodic) {
+        if (x < minval) {
+          x += 360.0f;
+        } else if (x >= minval + 360.0f) {
+          x -= 360.0f;
+        }
+      }
+      const float pos = (x - minval) / binSize;
+      return pos >= 0.0f && pos < static_cast<float>(nbins) ? static_cast<int64_t>(pos) : -1;
+    }
+
+    std::vector<float> centers() const {
+      std::vector<float> values;
+      for (size_t b = 0; b < nbins; b++) {
+        values.push_back(minval + (static_cast<float>(b) + 0.5f) * binSize);
+      }
+      return values;
+    }
+  };
+
+  // -----------------------------------------------------------------------------
+  // the "gridded statistics" of an obs space: maps and profiles on any of
+  // "latitude", "longitude" and "level" bins (level defaults to MetaData/pressure,
+  // use "variable: depth" for profiles in depth). Cells are numbered in the order
+  // of the axes, the last one varying fastest
+  class BinGrid {
+    public:
+    BinGrid() = default;
+    explicit BinGrid(const eckit::Configuration & conf) {
+      if (conf.has("latitude")) {
+        axes_.emplace_back(eckit::LocalConfiguration(conf, "latitude"), "Latitude",
+                           "latitudeBin", "latitude");
+      }
+      if (conf.has("longitude")) {
+        axes_.emplace_back(eckit::LocalConfiguration(conf, "longitude"), "Longitude",
+                           "longitudeBin", "longitude");
+      }
+      if (conf.has("level")) {
+        axes_.emplace_back(eckit::LocalConfiguration(conf, "level"), "Level", "levelBin",
+                           "pressure");
+      }
+      if (axes_.empty()) {
+        throw eckit::BadValue("gridded statistics need latitude, longitude or level bins");
+      }
+      if (ncells() > static_cast<size_t>(std::numeric_limits<int32_t>::max())) {
+        throw eckit::BadValue("gridded statistics have too many cells");
+      }
+    }
+
+    bool empty() const { return axes_.empty(); }
+    const std::vector<BinAxis> & axes() const { return axes_; }
+    size_t ncells() const {
+      size_t n = axes_.empty() ? 0 : 1;
+      for (const BinAxis & axis : axes_) n *= axis.nbins;
+      return n;
+    }
+
+    // the MetaData of every axis, read through the ArrayCache given to cells
+    void plan(ReadPlan & readPlan) const {
+      for (const BinAxis & axis : axes_) readPlan.addMetaData(axis.variable);
+    }
+
+    // cell of every one of the nlocs locations of the current block of cache, -1 outside
+    // of the grid. The cells are built one axis at a time
+    std::vector<int32_t> cells(ArrayCache & cache, const size_t nlocs) const {
+      std::vector<int32_t> cells(nlocs, 0);
+      for (const BinAxis & axis : axes_) {
+        const size_t id = cache.plan().metaData(axis.variable);
+        const std::vector<float> & values = cache.floats(id);
+        for (size_t i = 0; i < nlocs; i++) {
+          const int64_t bin = axis.index(values[i]);
+          const int64_t cell = cells[i] * static_cast<int64_t>(axis.nbins) + bin;
+          cells[i] = cells[i] < 0 || bin < 0 ? -1 : static_cast<int32_t>(cell);
+        }
+        cache.release(id);
+      }
+      return cells;
+    }
+
+    private:
+    std::vector<BinAxis> axes_;
+  };
+
+  // -----------------------------------------------------------------------------
+  // sub-window bins of "time bin size" (an ISO 8601 duration, PT1H for hourly bins)
+  // from the start of the time window, the last one ends at the end of the window
+  class TimeBins {
+    public:
+    TimeBins() = default;
+    TimeBins(const util::TimeWindow & timeWindow, const util::Duration & binSize)
+      : start_(timeWindow.start()), binSeconds_(binSize.toSeconds()) {
+      if (binSeconds_ <= 0) {
+        throw eckit::BadValue("time bin size must be positive, not " + binSize.toString());
+      }
+      const int64_t length = (timeWindow.end() - start_).toSeconds();
+      axis_.dimension = "TimeBin";
+      axis_.coordinateName = "timeBinOffset";
+      axis_.variable = "dateTime";
+      axis_.binSize = static_cast<float>(binSeconds_);
+      axis_.nbins = std::max<int64_t>(1, (length + binSeconds_ - 1) / binSeconds_);
+    }
+
+    bool empty() const { return axis_.nbins == 0; }
+    size_t nbins() const { return axis_.nbins; }
+    // the bins as an axis, its coordinate is the middle of each bin in seconds
+    // from the start of the window
+    const BinAxis & axis() const { return axis_; }
+
+    // the seconds of MetaData/dateTime, read through the ArrayCache given to bins,
+    // which counts them from the start of the window
+    void plan(ReadPlan & readPlan) const { readPlan.addSeconds(); }
+
+    // bin of every location of the current block of cache, from its MetaData/dateTime
+    // in whole seconds. The end of the window, when included, goes to the last bin
+    std::vector<int32_t> bins(ArrayCache & cache) const {
+      const size_t id = cache.plan().seconds();
+      const std::vector<int64_t> & seconds = cache.seconds(id);
+      std::vector<int32_t> bins(seconds.size());
+      const int64_t last = axis_.nbins - 1;
+      for (size_t i = 0; i < seconds.size(); i++) {
+        const int64_t bin = std::min(seconds[i] / binSeconds_, last);
+        bins[i] = seconds[i] < 0 ? -1 : static_cast<int32_t>(bin);
+      }
+      cache.release(id);
+      return bins;
+    }
+
+    private:
+    util::DateTime start_;
+    int64_t binSeconds_ = 0;
+    BinAxis axis_;
+  };
+
+  // -----------------------------------------------------------------------------
+  // accumulates the values of every location into the dense array of accumulators
+  // of its cell (times the channels) in a single scatter pass. The raw moments are
+  // summed in a scratch copy of the grid and merged into the accumulators of the
+  // touched cells every kChunkValues values. The scratch is kept from one call to
+  // the next
+  class GridAccumulator {
+    public:
+    GridAccumulator(const size_t ncells, const size_t nchans, const float fillVal)
+      : nchans_(std::max<size_t>(1, nchans)), scratch_(ncells, nchans, fillVal) {}
+
+    // data is nlocs x nchans as returned by get_db, accs has ncells x nchans entries
+    void accumulate(const std::vector<float> & data, const std::vector<int> & qcvals,
+                    const std::vector<int32_t> & cells, StatAccumulator * accs) {
+      const size_t chunkLocs = std::max<size_t>(1, ObsStats::kChunkValues / nchans_);
+      for (size_t start = 0; start < cells.size(); start += chunkLocs) {
+        const size_t end = std::min(cells.size(), start + chunkLocs);
+        for (size_t i = start; i < end; i++) {
+          if (cells[i] < 0) continue;
+          scratch_.add(cells[i], data.data() + i * nchans_, qcvals.data() + i * nchans_);
+        }
+        scratch_.merge(accs);
+      }
+    }
+
+    private:
+    const size_t nchans_;
+    CellScratch scratch_;
+  };
+}  // namespace dautils
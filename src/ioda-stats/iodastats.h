@@ -2,10 +2,13 @@
 
 #include <mpi.h>
 
+#include <algorithm>
 #include <cmath>
+#include <filesystem>
 #include <fstream>
 #include <iostream>
 #include <map>
+#include <memory>
 #include <numeric>
 #include <stdexcept>
 #include <string>
@@ -29,8 +32,18 @@
 #include "oops/util/missingValues.h"
 #include "oops/util/TimeWindow.h"
 
+#include "common/iodareader.h"
+
 #include "./calcstats.h"
+#include "./domains.h"
+#include "./gridbins.h"
+#include "./pipeline.h"
+#include "./readplan.h"
+#include "./regions.h"
+#include "./resultcache.h"
 #include "./statfile.h"
+#include "./statregistry.h"
+#include "./timers.h"
 
 namespace dautils {
   class IodaStats : public oops::Application {
@@ -55,177 +68,471 @@ namespace dautils {
         std::vector<eckit::LocalConfiguration> obsSpaces;
         fullConfig.get("obs spaces", obsSpaces);
 
-        // for now, just do this serially, eventually, make it parallelized
-        for (int i = 0; i < obsSpaces.size(); i++) {
-          // get the configuration for this obs space
-          auto obsSpace = obsSpaces[i];
-          eckit::LocalConfiguration obsConfig(obsSpace, "obs space");
+        // ocean basins and polygons used by the domains, rasterized once for all obs spaces
+        RegionRaster regions;
+        if (fullConfig.has("regions")) {
+          regions = RegionRaster(eckit::LocalConfiguration(fullConfig, "regions"), oceans_,
+                                 getComm());
+        }
 
-          // open the IODA file
-          std::string obsFile;
-          obsConfig.get("obsdatain.engine.obsfile", obsFile);
-          oops::Log::info() << "IODA-Stats: Processing " << obsFile << std::endl;
-          ioda::ObsSpace ospace(obsConfig, getComm(), timeWindow, getComm());
-          const size_t nlocs = ospace.nlocs();
-          oops::Log::info() << obsFile << ": nlocs =" << nlocs << std::endl;
-
-          // get the list of variables (and channels if applicable) to process
-          std::vector<std::string> variables;
-          std::vector<int> channels;
-          obsSpace.get("variables", variables);
-          if (obsSpace.has("channels")) {
-            obsSpace.get("channels", channels);
+        // optionally keep the results of every obs space in "result cache" (a directory),
+        // reruns with the same input files and configuration then skip reading them
+        ResultCache resultCache;
+        if (fullConfig.has("result cache")) {
+          std::string cacheDir;
+          fullConfig.get("result cache", cacheDir);
+          const eckit::LocalConfiguration regionsConf = fullConfig.has("regions")
+              ? eckit::LocalConfiguration(fullConfig, "regions") : eckit::LocalConfiguration();
+          resultCache = ResultCache(cacheDir, timeWindow, regionsConf, regions.source());
+        }
+
+        // optionally hand out whole obs spaces to ranks (or groups of ranks) instead of
+        // every rank reading a part of all of them
+        bool distribute = false;
+        if (fullConfig.has("distribute obs spaces")) {
+          fullConfig.get("distribute obs spaces", distribute);
+        }
+
+        if (!distribute) {
+          for (int i = 0; i < obsSpaces.size(); i++) {
+            processObsSpace(obsSpaces[i], timeWindow, regions, resultCache, getComm());
+          }
+        } else if (!obsSpaces.empty()) {
+          // balance on input file size, the biggest obs spaces are placed first
+          std::vector<double> weights;
+          for (const auto & obsSpace : obsSpaces) {
+            weights.push_back(obsSpaceWeight(obsSpace));
+          }
+          // one task per rank, or per group of ranks when there are more ranks than obs spaces
+          const size_t ntasks = std::min(getComm().size(), obsSpaces.size());
+          const std::vector<size_t> owners = balanceObsSpaces(weights, ntasks);
+          const size_t task = rankTask(weights, owners, ntasks, getComm().size(), getComm().rank());
+          eckit::mpi::Comm & taskComm = getComm().split(task, "ioda-stats-task");
+          for (int i = 0; i < obsSpaces.size(); i++) {
+            if (owners[i] == task) {
+              processObsSpace(obsSpaces[i], timeWindow, regions, resultCache, taskComm);
+            }
           }
+          getComm().barrier();
+          eckit::mpi::deleteComm("ioda-stats-task");
+        }
+        return 0;
+      }
+      // -----------------------------------------------------------------------------
+      // compute and write the statistics of one entry of "obs spaces" using comm
+      void processObsSpace(const eckit::LocalConfiguration & obsSpace,
+                           const util::TimeWindow & timeWindow,
+                           const RegionRaster & regions,
+                           const ResultCache & resultCache,
+                           const eckit::mpi::Comm & comm) const {
+        eckit::LocalConfiguration obsConfig(obsSpace, "obs space");
+
+        // the IODA file
+        std::string obsFile;
+        obsConfig.get("obsdatain.engine.obsfile", obsFile);
+        oops::Log::info() << "IODA-Stats: Processing " << obsFile << std::endl;
+        // with direct read only the arrays used below are read from the file,
+        // without building an ObsSpace
+        bool directRead = false;
+        if (obsSpace.has("direct read")) {
+          obsSpace.get("direct read", directRead);
+        }
+        // with parallel output every rank writes the statistics of a block of domains
+        // to the stat file opened on comm with MPI-IO, rather than the root writing all
+        bool parallelOutput = false;
+        if (obsSpace.has("parallel output")) {
+          obsSpace.get("parallel output", parallelOutput);
+        }
+        // time and bytes of every phase on this rank, gathered on the root and
+        // written with the statistics
+        PhaseTimers timers({"open", "masks", "read", "kernels", "mpi reduce", "write"});
+
+        // get the list of variables (and channels if applicable) to process
+        std::vector<std::string> variables;
+        std::vector<int> channels;
+        obsSpace.get("variables", variables);
+        if (obsSpace.has("channels")) {
+          obsSpace.get("channels", channels);
+        }
+
+        // channels only works if there is one variable, so need to check this
+        if (variables.size() > 1 && !channels.empty()) {
+          throw eckit::Exception("Cannot use channels with multiple variables.");
+        }
+
+        // get the lists of everything to process/compute
+        std::vector<std::string> groups;
+        std::vector<std::string> stats;
+        std::vector<std::string> qcgroups;
+        std::vector<eckit::LocalConfiguration> domains;
+        
+        obsSpace.get("groups to process", groups);
+        obsSpace.get("qc groups", qcgroups);
+        obsSpace.get("statistics to compute", stats);
+        // resolved once, gives what to write and which moments to accumulate
+        const StatPlan plan(stats, DistributionConfig(obsSpace));
+
+        obsSpace.get("domains to process", domains);
+        // loop over all domains and get their definitions
+        std::vector<Domain> domainDefs;
+        std::vector<std::string> domainNames;
+        for (int idom = 0; idom < domains.size(); idom++ ) {
+          domainDefs.emplace_back(eckit::LocalConfiguration(domains[idom], "domain"));
+          domainNames.push_back(domainDefs.back().name);
+        }
 
-          // channels only works if there is one variable, so need to check this
-          if (variables.size() > 1 && !channels.empty()) {
-            throw eckit::Exception("Cannot use channels with multiple variables.");
+        // assert that the QC groups list is the same size as groups
+        assert(groups.size() == qcgroups.size());
+
+        // partial statistics of this rank for every variable, group, domain and channel,
+        // they are merged over comm before anything is written
+        const size_t nchans = std::max<size_t>(1, channels.size());
+        const size_t ndomains = domains.size() + 1;
+        std::vector<StatAccumulator> partials(variables.size() * groups.size() * ndomains * nchans);
+        auto slot = [&](const size_t var, const size_t g, const size_t idom) {
+          return ((var * groups.size() + g) * ndomains + idom) * nchans;
+        };
+        // quantile sketches and histograms, in the same slots, when asked for
+        const bool distributions = (plan.needs() & kNeedDistribution) != 0;
+        std::vector<Distribution> partialDists(distributions ? partials.size() : 0,
+                                               plan.distribution());
+        // optional maps and profiles: every location goes to the cell of its
+        // latitude/longitude/level bins, one dense grid of accumulators per variable and group
+        BinGrid grid;
+        if (obsSpace.has("gridded statistics")) {
+          grid = BinGrid(eckit::LocalConfiguration(obsSpace, "gridded statistics"));
+        }
+        const size_t ncells = grid.ncells();
+        std::vector<StatAccumulator> gridPartials(variables.size() * groups.size() * ncells
+                                                  * nchans);
+        auto gridSlot = [&](const size_t var, const size_t g) {
+          return (var * groups.size() + g) * ncells * nchans;
+        };
+        GridAccumulator gridAcc(ncells, channels.size(), util::missingValue<float>());
+        std::vector<int32_t> cells;
+        // optional sub-window statistics of every domain, per "time bin size" from the
+        // start of the window, accumulated along with the domain statistics
+        TimeBins timeBins;
+        if (obsSpace.has("time bin size")) {
+          std::string binSize;
+          obsSpace.get("time bin size", binSize);
+          timeBins = TimeBins(timeWindow, util::Duration(binSize));
+        }
+        const size_t ntimes = timeBins.nbins();
+        std::vector<StatAccumulator> timePartials(variables.size() * groups.size() * ndomains
+                                                  * ntimes * nchans);
+        auto timeSlot = [&](const size_t var, const size_t g) {
+          return (var * groups.size() + g) * ndomains * ntimes * nchans;
+        };
+        std::vector<int32_t> timeCells;
+        // optional statistics comparing two groups (O-B with O-A, ObsValue with hofx...)
+        // over the locations valid in both, written under a group combining them
+        std::vector<GroupPair> pairs;
+        PairStatPlan pairPlan;
+        if (obsSpace.has("paired statistics")) {
+          const eckit::LocalConfiguration pairedConf(obsSpace, "paired statistics");
+          pairs = groupPairs(pairedConf, groups, qcgroups);
+          std::vector<std::string> pairStats;
+          pairedConf.get("statistics to compute", pairStats);
+          pairPlan = PairStatPlan(pairStats);
+        }
+        std::vector<PairAccumulator> pairPartials(variables.size() * pairs.size() * ndomains
+                                                  * nchans);
+        auto pairSlot = [&](const size_t var, const size_t p) {
+          return (var * pairs.size() + p) * ndomains * nchans;
+        };
+
+        // a rerun of an obs space whose input file and configuration have not changed
+        // writes the accumulators kept by the previous run, without reading the file
+        const size_t root = 0;
+        // (not with parallel output, where no rank holds all the reduced accumulators)
+        const std::string cacheKey = parallelOutput ? "" : resultCache.key(obsSpace, obsFile);
+        std::vector<char> cachedState;
+        int cached = comm.rank() == root && resultCache.load(cacheKey, cachedState);
+        comm.broadcast(cached, root);
+        if (cached) {
+          oops::Log::info() << obsFile << ": statistics found in the result cache" << std::endl;
+        } else {
+          // open the IODA file
+          std::unique_ptr<ObsSource> source;
+          {
+            PhaseTimers::Scope timing(timers, "open");
+            source = openObsSource(obsConfig, timeWindow, comm, directRead);
           }
+          ObsSource & ospace = *source;
+          oops::Log::info() << obsFile << ": locations of this rank =" << ospace.sliceSize()
+                            << std::endl;
 
-          // get the lists of everything to process/compute
-          std::vector<std::string> groups;
-          std::vector<std::string> stats;
-          std::vector<std::string> qcgroups;
-          std::vector<eckit::LocalConfiguration> domains;
-          
-          obsSpace.get("groups to process", groups);
-          obsSpace.get("qc groups", qcgroups);
-          obsSpace.get("statistics to compute", stats);
-
-          obsSpace.get("domains to process", domains);
-          // loop over all domains and get their definitions
-          std::vector<std::string> domainNames;
-          std::vector<std::string> domainMaskVar1;
-          std::vector<std::string> domainMaskVar2;
-          std::vector<std::string> domainMaskVar3;
-          std::vector<std::vector<float>> domainMaskVals1;
-          std::vector<std::vector<float>> domainMaskVals2;
-          std::vector<std::vector<float>> domainMaskVals3;
-          for (int idom = 0; idom < domains.size(); idom++ ) {
-            auto domain = domains[idom];
-            eckit::LocalConfiguration domainConf(domain, "domain");
-            std::string domainname;
-            std::string maskvar1, maskvar2, maskvar3;
-            std::vector<float> maskvals1, maskvals2, maskvals3;
-            domainConf.get("name", domainname);
-            if (domainConf.has("first mask variable")) {
-              domainConf.get("first mask variable", maskvar1);
-              domainConf.get("first mask range", maskvals1);
+          // optionally stream over blocks of locations, the statistics of each block are
+          // merged into the partials and its buffers reused, so memory stays the same
+          // whatever the size of the file
+          const size_t sliceLocs = ospace.sliceSize();
+          const size_t blockLocs = locationBlockSize(obsSpace, ospace, nchans, directRead);
+
+          // one task per (variable, group): read its values and QC flags, then reduce
+          // them over every domain. The arrays are planned before anything is read so
+          // each is read once however many tasks use it, and freed after its last one.
+          // The MetaData of the masks and bins go through the same plan
+          ReadPlan readPlan(variables, groups, qcgroups, pairs);
+          planDomainMasks(readPlan, domainDefs, regions);
+          if (!grid.empty()) grid.plan(readPlan);
+          if (!timeBins.empty()) timeBins.plan(readPlan);
+          ArrayCache cache(readPlan, ospace, channels, timeWindow.start());
+          const size_t ntasks = readPlan.tasks().size();
+          auto read = [&](const size_t task, ReadBuffers & buffers) {
+            PhaseTimers::Scope timing(timers, "read");
+            const ReadPlan::Task & item = readPlan.tasks()[task];
+            buffers.values = &cache.floats(item.values);
+            buffers.qcflags = &cache.ints(item.qcflags);
+            buffers.values2 = item.paired ? &cache.floats(item.values2) : nullptr;
+            buffers.qcflags2 = item.paired ? &cache.ints(item.qcflags2) : nullptr;
+          };
+          bool firstBlock = true;
+          auto reduce = [&](const size_t task, const ReadBuffers & buffers,
+                            const DomainMasks & mask) {
+            PhaseTimers::Scope timing(timers, "kernels");
+            const ReadPlan::Task & item = readPlan.tasks()[task];
+            timers.addBytes("kernels", (item.paired ? 2 : 1) * buffers.values->size()
+                                       * (sizeof(float) + sizeof(int)));
+            const size_t var = item.variable;
+            const size_t g = item.group;
+            if (item.paired) {
+              if (firstBlock) {
+                oops::Log::info() << obsFile << ": Now processing " << pairs[g].name << "/"
+                                  << variables[var] << std::endl;
+              }
+              ObsStats obstat;
+              obstat.accumulatePairs(*buffers.values, *buffers.qcflags, *buffers.values2,
+                                     *buffers.qcflags2, mask.domains(), channels.size(),
+                                     &pairPartials[pairSlot(var, g)]);
+              for (const size_t id : {item.values, item.qcflags, item.values2, item.qcflags2}) {
+                cache.release(id);
+              }
+              return;
             }
-            if (domainConf.has("second mask variable")) {
-              domainConf.get("second mask variable", maskvar2);
-              domainConf.get("second mask range", maskvals2);
+            if (firstBlock) {
+              oops::Log::info() << obsFile << ": Now processing "
+                                << groups[g] << "/" << variables[var] << std::endl;
             }
-            if (domainConf.has("third mask variable")) {
-              domainConf.get("third mask variable", maskvar3);
-              domainConf.get("third mask range", maskvals3);
+            // every domain in one pass over the data, split over the OpenMP threads
+            ObsStats obstat;
+            Distribution *dists = distributions ? &partialDists[slot(var, g, 0)] : nullptr;
+            // and the time bins of every domain along with them
+            const bool binned = !timeBins.empty();
+            obstat.accumulateDomains(*buffers.values, *buffers.qcflags, mask.domains(),
+                                     channels.size(), plan.needs(), &partials[slot(var, g, 0)],
+                                     dists, binned ? timeCells.data() : nullptr, ntimes,
+                                     binned ? &timePartials[timeSlot(var, g)] : nullptr);
+            if (!grid.empty()) {
+              gridAcc.accumulate(*buffers.values, *buffers.qcflags, cells,
+                                 &gridPartials[gridSlot(var, g)]);
             }
-            domainNames.push_back(domainname);
-            domainMaskVar1.push_back(maskvar1);
-            domainMaskVar2.push_back(maskvar2);
-            domainMaskVar3.push_back(maskvar3);
-            domainMaskVals1.push_back(maskvals1);
-            domainMaskVals2.push_back(maskvals2);
-            domainMaskVals3.push_back(maskvals3);
+            cache.release(item.values);
+            cache.release(item.qcflags);
+          };
+
+          // with prefetch reads the next task is read on a second thread while the current
+          // one is reduced
+          bool prefetch = false;
+          if (obsSpace.has("prefetch reads")) {
+            obsSpace.get("prefetch reads", prefetch);
           }
+          std::vector<ReadBuffers> pool(prefetch ? 2 : 1);
+          for (size_t first = 0; first < sliceLocs; first += blockLocs) {
+            ospace.selectLocations(first, std::min(blockLocs, sliceLocs - first));
+            // packed masks of every domain (and the global domain last)
+            cache.reset();
+            auto timing = std::make_unique<PhaseTimers::Scope>(timers, "masks");
+            const DomainMasks mask = computeDomainMasks(cache, ospace.nlocs(), domainDefs,
+                                                        regions);
+            if (!grid.empty()) cells = grid.cells(cache, ospace.nlocs());
+            if (!timeBins.empty()) timeCells = timeBins.bins(cache);
+            timing.reset();
 
-          // assert that the QC groups list is the same size as groups
-          assert(groups.size() == qcgroups.size());
-
-          // initialize netCDF output file for writing
-          std::string outfile;
-          obsSpace.get("output file", outfile);
-          StatFile statfile;
-          statfile.initializeNcfile(outfile, timeWindow, variables, channels, groups, stats, domainNames);
-
-          // loop over domains, compute the masks for each
-          std::vector<std::vector<int>> mask(domains.size()+1, std::vector<int>(nlocs, 0));
-          for (int idom = 0; idom < domains.size(); idom++ ) {
-            // compute mask with function 3 times, one for each possible mask
-            ObsStats obstatmask;
-            std::vector<float> maskvalues(nlocs);
-            if (!domainMaskVar1[idom].empty()) {
-              ospace.get_db("MetaData", domainMaskVar1[idom], maskvalues);
-              mask[idom] = obstatmask.update_mask(maskvalues, domainMaskVals1[idom][0], domainMaskVals1[idom][1], mask[idom]);
-            }
-            if (!domainMaskVar2[idom].empty()) {
-              ospace.get_db("MetaData", domainMaskVar2[idom], maskvalues);
-              mask[idom] = obstatmask.update_mask(maskvalues, domainMaskVals2[idom][0], domainMaskVals2[idom][1], mask[idom]);
+            if (prefetch) {
+              ReadPipeline pipeline(pool, ntasks, read);
+              for (size_t task = 0; task < ntasks; task++) reduce(task, *pipeline.next(), mask);
+            } else {
+              for (size_t task = 0; task < ntasks; task++) {
+                read(task, pool[0]);
+                reduce(task, pool[0], mask);
+              }
             }
-            if (!domainMaskVar3[idom].empty()) {
-              ospace.get_db("MetaData", domainMaskVar3[idom], maskvalues);
-              mask[idom] = obstatmask.update_mask(maskvalues, domainMaskVals3[idom][0], domainMaskVals3[idom][1], mask[idom]);
+            firstBlock = false;
+          }
+          timers.addBytes("read", cache.bytesRead());
+
+          // one packed reduction for the whole obs space, only the root finalizes and writes
+          {
+            PhaseTimers::Scope timing(timers, "mpi reduce");
+            if (parallelOutput) {
+              // each block of domains onto the rank writing it, the grid onto the
+              // rank of the Global domain
+              reduceDomains(partials, ndomains, nchans, comm,
+                            reduceScatterAccumulators<StatAccumulator>);
+              reduceDomains(partialDists, ndomains, nchans, comm, reduceScatterDistributions);
+              reduceAccumulators(gridPartials, comm, comm.size() - 1);
+              reduceDomains(timePartials, ndomains, ntimes * nchans, comm,
+                            reduceScatterAccumulators<StatAccumulator>);
+              reduceDomains(pairPartials, ndomains, nchans, comm,
+                            reduceScatterAccumulators<PairAccumulator>);
+            } else {
+              reduceAccumulators(partials, comm, root);
+              reduceDistributions(partialDists, comm, root);
+              reduceAccumulators(gridPartials, comm, root);
+              reduceAccumulators(timePartials, comm, root);
+              reduceAccumulators(pairPartials, comm, root);
             }
           }
+          // keep the reduced accumulators for the next run
+          if (comm.rank() == root && resultCache.enabled()) {
+            std::vector<char> state;
+            ResultCache::put(state, partials);
+            ResultCache::put(state, partialDists);
+            ResultCache::put(state, gridPartials);
+            ResultCache::put(state, timePartials);
+            ResultCache::put(state, pairPartials);
+            resultCache.store(cacheKey, state);
+          }
+        }
+        std::vector<double> timings = timers.gather(comm, root);
+        if (comm.rank() != root && !parallelOutput) return;
+        if (cached) {
+          const char * buf = cachedState.data();
+          const char * end = buf + cachedState.size();
+          ResultCache::get(buf, end, partials);
+          ResultCache::get(buf, end, partialDists);
+          ResultCache::get(buf, end, gridPartials);
+          ResultCache::get(buf, end, timePartials);
+          ResultCache::get(buf, end, pairPartials);
+        }
+        auto writing = std::make_unique<PhaseTimers::Scope>(timers, "write");
 
-          // loop over variables
-          for (int var = 0; var < variables.size(); var++) {
-            // loop over groups
-            for (int g = 0; g < groups.size(); g++) {
-              oops::Log::info() << obsFile << ": Now processing "
-                                << groups[g] << "/" << variables[var] << std::endl;
-              std::vector<float> buffer(nlocs);
-              std::vector<int> qcflag(nlocs);
-              // we have to process differently if there are channels
-              if (channels.empty()) {
-                // read the full variable
-                ospace.get_db(groups[g], variables[var], buffer);
-                // get the QC group
-                ospace.get_db(qcgroups[g], variables[var], qcflag);
-              } else {
-                // give the list of channels to read
-                ospace.get_db(groups[g], variables[var], buffer, channels);
-                // get the QC group
-                ospace.get_db(qcgroups[g], variables[var], qcflag, channels);
+        // initialize netCDF output file for writing
+        std::string outfile;
+        obsSpace.get("output file", outfile);
+        // optionally add this cycle to an existing stat file to build a time series
+        bool append = false;
+        if (obsSpace.has("append to output file")) {
+          obsSpace.get("append to output file", append);
+        }
+        auto initialize = [&](StatFile & file, const bool appendCycle) {
+          file.initializeNcfile(outfile, timeWindow, variables, channels, groups, plan,
+                                domainNames, appendCycle);
+          if (!grid.empty()) file.initializeGrid(grid, variables, groups, plan);
+          if (!timeBins.empty()) file.initializeTimeBins(timeBins, variables, groups, plan);
+          if (!pairs.empty()) file.initializePairs(pairs, variables, pairPlan);
+        };
+        // in parallel output the root defines the file (or adds this cycle to it) on
+        // its own, then every rank opens it to write its domains
+        if (parallelOutput) {
+          if (comm.rank() == root) {
+            StatFile definition;
+            initialize(definition, append);
+            definition.close();
+          }
+          comm.barrier();
+        }
+        StatFile statfile(parallelOutput ? &comm : nullptr);
+        initialize(statfile, append || parallelOutput);
+
+        // binned statistics of one variable and group: the moment based statistics
+        // of every accumulator, written in one piece
+        auto writeBinned = [&](const std::string & subgroup, const size_t var, const size_t g,
+                               const std::vector<StatAccumulator> & binAccs) {
+          std::vector<int> intstat;
+          std::vector<float> floatstat;
+          for (const StatEntry & stat : plan.entries()) {
+            if ((stat.needs & kNeedDistribution) != 0) continue;
+            stat.finalize(binAccs, {}, plan.distributionConfig(), fillVal_, intstat, floatstat);
+            if (stat.integer) {
+              statfile.writeBinned(subgroup, groups[g], variables[var], stat.name, intstat);
+            } else {
+              statfile.writeBinned(subgroup, groups[g], variables[var], stat.name, floatstat);
+            }
+          }
+        };
 
+        for (int var = 0; var < variables.size(); var++) {
+          for (int g = 0; g < groups.size(); g++) {
+            oops::Log::info() << obsFile << ": Statistics of "
+                              << groups[g] << "/" << variables[var] << std::endl;
+            for (int idom = 0; idom < ndomains; idom++ ) {
+              if (!statfile.ownsDomain(idom)) continue;
+              if (idom < domains.size()) {
+                oops::Log::info() << "Processing domain: " << domainNames[idom] << std::endl;
+                oops::Log::info() << domainDefs[idom].describe() << std::endl;
               }
-              // loop over domains
-              for (int idom = 0; idom < domains.size()+1; idom++ ) {
-                if (idom < domains.size()) {
-                  oops::Log::info() << "Processing domain: " << domainNames[idom] << std::endl;
-                  oops::Log::info() << domainMaskVar1[idom] << "=" <<  domainMaskVals1[idom] << ";"
-                           << domainMaskVar2[idom] << "=" <<  domainMaskVals2[idom] << ";"
-                           << domainMaskVar3[idom] << "=" <<  domainMaskVals3[idom] << ";"
-                           << std::endl;
+              const std::vector<StatAccumulator> accs(partials.begin() + slot(var, g, idom),
+                                                      partials.begin() + slot(var, g, idom) + nchans);
+              const std::vector<Distribution> dists(
+                  distributions ? partialDists.begin() + slot(var, g, idom) : partialDists.end(),
+                  distributions ? partialDists.begin() + slot(var, g, idom) + nchans
+                                : partialDists.end());
+              // loop over stats
+              std::vector<int> intstat;
+              std::vector<float> floatstat;
+              for (const StatEntry & stat : plan.entries()) {
+                stat.finalize(accs, dists, plan.distributionConfig(), fillVal_, intstat, floatstat);
+                if (stat.integer) {
+                  oops::Log::info() << stat.name << ":" << intstat << std::endl;
+                  statfile.write(groups[g], variables[var], stat.name, idom, intstat);
+                } else {
+                  oops::Log::info() << stat.name << ":" << floatstat << std::endl;
+                  statfile.write(groups[g], variables[var], stat.name, idom, floatstat);
                 }
-                // loop over stats
-                ObsStats obstat;
-                for (int s = 0; s < stats.size(); s++) {
-                  // Maybe eventually set this up as a factory but for now just do it
-                  // with this old school if/else if way
-                  std::vector<int> intstat;
-                  std::vector<float> floatstat;
-                  if (stats[s] == "count") {
-                    intstat = obstat.getObsCount(buffer, qcflag, channels, mask[idom]);
-                    oops::Log::info() << "Count:" << intstat << std::endl; 
-                  } else if (stats[s] == "mean") {
-                    floatstat = obstat.getMean(buffer, qcflag, channels, mask[idom]);
-                    oops::Log::info() << "Mean:" << floatstat << std::endl; 
-                  } else if (stats[s] == "RMS") {
-                    floatstat = obstat.getRMS(buffer, qcflag, channels, mask[idom]);
-                    oops::Log::info() << "RMS:" << floatstat << std::endl;
-                  } else {
-                    oops::Log::info() << stats[s] << " not supported. Skipping." << std::endl;
-                  }
-                  if (stats[s] == "count") {
-                    statfile.write(outfile, groups[g], variables[var],
-                                   stats[s], idom, intstat);
-                  } else {
-                    statfile.write(outfile, groups[g], variables[var],
-                                   stats[s], idom, floatstat);
-                  }
+              }
+            }
+            if (!grid.empty()) {
+              writeBinned("gridded", var, g, std::vector<StatAccumulator>(
+                  gridPartials.begin() + gridSlot(var, g),
+                  gridPartials.begin() + gridSlot(var, g) + ncells * nchans));
+            }
+            if (!timeBins.empty()) {
+              writeBinned("timeBinned", var, g, std::vector<StatAccumulator>(
+                  timePartials.begin() + timeSlot(var, g),
+                  timePartials.begin() + timeSlot(var, g) + ndomains * ntimes * nchans));
+            }
+          }
+        }
+        for (int var = 0; var < variables.size(); var++) {
+          for (size_t p = 0; p < pairs.size(); p++) {
+            oops::Log::info() << obsFile << ": Statistics of "
+                              << pairs[p].name << "/" << variables[var] << std::endl;
+            for (int idom = 0; idom < ndomains; idom++ ) {
+              if (!statfile.ownsDomain(idom)) continue;
+              const std::vector<PairAccumulator> accs(
+                  pairPartials.begin() + pairSlot(var, p) + idom * nchans,
+                  pairPartials.begin() + pairSlot(var, p) + (idom + 1) * nchans);
+              std::vector<int> intstat;
+              std::vector<float> floatstat;
+              for (const PairStatEntry & stat : pairPlan.entries()) {
+                stat.finalize(accs, intstat, floatstat);
+                if (stat.integer) {
+                  oops::Log::info() << stat.name << ":" << intstat << std::endl;
+                  statfile.write(pairs[p].name, variables[var], stat.name, idom, intstat);
+                } else {
+                  oops::Log::info() << stat.name << ":" << floatstat << std::endl;
+                  statfile.write(pairs[p].name, variables[var], stat.name, idom, floatstat);
                 }
               }
             }
           }
         }
-        return 0;
+        // write out everything computed for this obs space, then how long it took
+        statfile.flush();
+        writing.reset();
+        if (comm.rank() == root) timers.update(timings, root);
+        writeTimings(obsSpace, obsFile, timers, timings, statfile);
+        statfile.close();
       }
 
     // -----------------------------------------------------------------------------
     // Data members
     std::map<std::string, int> oceans_;
     double fillVal_;
+    // default number of values (locations x channels) per block when streaming
+    static constexpr size_t kStreamValues = size_t(1) << 22;
     // -----------------------------------------------------------------------------
     // -----------------------------------------------------------------------------
    private:
@@ -233,5 +540,190 @@ namespace dautils {
       return "dautils::IodaExample";
     }
     // -----------------------------------------------------------------------------
+    // task of this rank: every task gets one rank, the remaining ranks go one at a time
+    // to the task with the most work per rank, ranks of a task are contiguous
+    static size_t rankTask(const std::vector<double> & weights, const std::vector<size_t> & owners,
+                           const size_t ntasks, const size_t nranks, const size_t rank) {
+      std::vector<double> load(ntasks, 0.0);
+      for (size_t i = 0; i < weights.size(); i++) {
+        load[owners[i]] += std::max(weights[i], 1.0);
+      }
+      std::vector<size_t> nranksTask(ntasks, 1);
+      for (size_t extra = ntasks; extra < nranks; extra++) {
+        size_t busiest = 0;
+        for (size_t t = 1; t < ntasks; t++) {
+          if (load[t] / nranksTask[t] > load[busiest] / nranksTask[busiest]) busiest = t;
+        }
+        nranksTask[busiest]++;
+      }
+      size_t first = 0;
+      for (size_t t = 0; t < ntasks; t++) {
+        if (rank < first + nranksTask[t]) return t;
+        first += nranksTask[t];
+      }
+      return ntasks - 1;
+    }
+    // -----------------------------------------------------------------------------
+    // locations read at once: all of them, unless "stream locations" is set, then
+    // "locations per block" or about kStreamValues values per block rounded up to
+    // whole HDF5 chunks so each chunk is read once
+    static size_t locationBlockSize(const eckit::LocalConfiguration & obsSpace,
+                                    const ObsSource & source, const size_t nchans,
+                                    const bool directRead) {
+      const size_t sliceLocs = std::max<size_t>(1, source.sliceSize());
+      bool stream = false;
+      if (obsSpace.has("stream locations")) {
+        obsSpace.get("stream locations", stream);
+      }
+      if (stream && !directRead) {
+        oops::Log::warning() << "stream locations needs direct read, "
+                             << "reading all locations at once" << std::endl;
+        stream = false;
+      }
+      if (!stream) return sliceLocs;
+      size_t block = 0;
+      if (obsSpace.has("locations per block")) {
+        obsSpace.get("locations per block", block);
+      } else {
+        block = std::max<size_t>(1, kStreamValues / nchans);
+        const size_t chunk = source.fileChunkSize();
+        if (chunk > 0) block = (block + chunk - 1) / chunk * chunk;
+      }
+      return std::min(sliceLocs, std::max<size_t>(1, block));
+    }
+    // -----------------------------------------------------------------------------
+    // reduce partials laid out as [...][domain][inner] over comm, each block of domains
+    // onto the rank writing it in parallel output (see domainBlock): the blocks of every
+    // rank are laid out one after the other for a single reduceScatter over comm
+    template <typename T, typename ReduceScatter>
+    static void reduceDomains(std::vector<T> & partials, const size_t ndomains,
+                              const size_t inner, const eckit::mpi::Comm & comm,
+                              ReduceScatter reduceScatter) {
+      if (partials.empty() || comm.size() == 1) return;
+      const size_t outer = partials.size() / (ndomains * inner);
+      std::vector<T> blocks;
+      blocks.reserve(partials.size());
+      std::vector<int> counts(comm.size());
+      for (size_t rank = 0; rank < comm.size(); rank++) {
+        const std::pair<size_t, size_t> block = domainBlock(ndomains, comm.size(), rank);
+        const size_t width = (block.second - block.first) * inner;
+        counts[rank] = static_cast<int>(outer * width);
+        for (size_t o = 0; o < outer && width > 0; o++) {
+          const auto first = partials.begin() + (o * ndomains + block.first) * inner;
+          blocks.insert(blocks.end(), first, first + width);
+        }
+      }
+      reduceScatter(blocks, counts, comm);
+      const std::pair<size_t, size_t> block = domainBlock(ndomains, comm.size(), comm.rank());
+      const size_t width = (block.second - block.first) * inner;
+      for (size_t o = 0; o < outer && width > 0; o++) {
+        std::copy(blocks.begin() + o * width, blocks.begin() + (o + 1) * width,
+                  partials.begin() + (o * ndomains + block.first) * inner);
+      }
+    }
+    // -----------------------------------------------------------------------------
+    // the "pairs" of "paired statistics": two "groups", their "qc groups", by default
+    // those given to the same groups in "groups to process", and the "name" of the
+    // combined output group, by default the two group names joined by an underscore
+    static std::vector<GroupPair> groupPairs(const eckit::LocalConfiguration & pairedConf,
+                                             const std::vector<std::string> & groups,
+                                             const std::vector<std::string> & qcgroups) {
+      std::vector<eckit::LocalConfiguration> pairConfs;
+      pairedConf.get("pairs", pairConfs);
+      std::vector<GroupPair> pairs;
+      for (const auto & pairConf : pairConfs) {
+        std::vector<std::string> pairGroups;
+        pairConf.get("groups", pairGroups);
+        if (pairGroups.size() != 2) {
+          throw eckit::BadValue("paired statistics need two groups per pair");
+        }
+        GroupPair pair;
+        pair.name = pairGroups[0] + "_" + pairGroups[1];
+        if (pairConf.has("name")) {
+          pairConf.get("name", pair.name);
+        }
+        std::vector<std::string> pairQcGroups;
+        if (pairConf.has("qc groups")) {
+          pairConf.get("qc groups", pairQcGroups);
+        } else {
+          for (const std::string & group : pairGroups) {
+            const auto it = std::find(groups.begin(), groups.end(), group);
+            if (it == groups.end()) {
+              throw eckit::BadValue("paired statistics of " + pair.name + " need qc groups, "
+                                    + group + " is not in groups to process");
+            }
+            pairQcGroups.push_back(qcgroups[it - groups.begin()]);
+          }
+        }
+        if (pairQcGroups.size() != 2) {
+          throw eckit::BadValue("paired statistics of " + pair.name + " need two qc groups");
+        }
+        for (size_t k = 0; k < 2; k++) {
+          pair.groups[k] = pairGroups[k];
+          pair.qcgroups[k] = pairQcGroups[k];
+        }
+        pairs.push_back(pair);
+      }
+      return pairs;
+    }
+    // -----------------------------------------------------------------------------
+    // the time, bytes and peak memory of every phase gathered over the ranks, as global
+    // attributes of the stat file (max time, total bytes, max peak RSS over the ranks)
+    // and, with "timing file", as a line of JSON with the numbers of each rank.
+    // Only the root has the gathered numbers, in parallel output the other ranks
+    // take the attributes of the root
+    static void writeTimings(const eckit::LocalConfiguration & obsSpace,
+                             const std::string & obsFile, const PhaseTimers & timers,
+                             const std::vector<double> & timings, StatFile & statfile) {
+      const std::vector<std::string> & phases = timers.phases();
+      for (size_t p = 0; p < phases.size(); p++) {
+        std::string phase = phases[p];
+        std::replace(phase.begin(), phase.end(), ' ', '_');
+        statfile.putAttribute("ioda_stats_" + phase + "_seconds", timers.maxSeconds(timings, p));
+        statfile.putAttribute("ioda_stats_" + phase + "_bytes", timers.totalBytes(timings, p));
+        if (!timings.empty()) {
+          oops::Log::info() << obsFile << ": " << phases[p] << " took "
+                            << timers.maxSeconds(timings, p) << " s" << std::endl;
+        }
+      }
+      statfile.putAttribute("ioda_stats_peak_rss_bytes", timers.maxPeakRSS(timings));
+      statfile.putAttribute("ioda_stats_timings", timers.json(obsFile, timings));
+      if (obsSpace.has("timing file") && !timings.empty()) {
+        std::string timingFile;
+        obsSpace.get("timing file", timingFile);
+        std::ofstream out(timingFile, std::ios::app);
+        if (!out) throw eckit::UserError("IODA-Stats: cannot write " + timingFile);
+        out << timers.json(obsFile, timings) << std::endl;
+      }
+    }
+    // -----------------------------------------------------------------------------
+    // load estimate of an obs space, the size of its input file
+    static double obsSpaceWeight(const eckit::LocalConfiguration & obsSpace) {
+      std::string obsFile;
+      obsSpace.get("obs space.obsdatain.engine.obsfile", obsFile);
+      std::error_code ec;
+      const std::uintmax_t size = std::filesystem::file_size(obsFile, ec);
+      return ec ? 0.0 : static_cast<double>(size);
+    }
+    // -----------------------------------------------------------------------------
+    // greedy longest processing time first: each obs space, largest first,
+    // goes to the task with the least work assigned so far
+    static std::vector<size_t> balanceObsSpaces(const std::vector<double> & weights,
+                                                const size_t ntasks) {
+      std::vector<size_t> order(weights.size());
+      std::iota(order.begin(), order.end(), 0);
+      std::stable_sort(order.begin(), order.end(),
+                       [&weights](size_t a, size_t b) { return weights[a] > weights[b]; });
+      std::vector<double> load(ntasks, 0.0);
+      std::vector<size_t> owners(weights.size(), 0);
+      for (const size_t i : order) {
+        const size_t task = std::min_element(load.begin(), load.end()) - load.begin();
+        owners[i] = task;
+        // empty or missing files still cost an ObsSpace construction
+        load[task] += std::max(weights[i], 1.0);
+      }
+      return owners;
+    }
+    // -----------------------------------------------------------------------------
   };
 }  // namespace dautils
@@ -0,0 +1,12 @@
+#include "iodastatsbench.h"
+#include "oops/runs/Run.h"
+
+// This application times the statistics kernels and the stat file
+// output of ioda-stats on synthetic observations, and optionally
+// checks their results against a plain reference
+
+int main(int argc, char ** argv) {
+  oops::Run run(argc, argv);
+  dautils::IodaStatsBench bench;
+  return run.execute(bench);
+}
@@ -0,0 +1,719 @@
+#pragma once
+
+#include <netcdf>
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <iomanip>
+#include <limits>
+#include <map>
+#include <random>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "eckit/config/LocalConfiguration.h"
+#include "eckit/exception/Exceptions.h"
+
+#include "ioda/Engines/EngineUtils.h"
+#include "ioda/ObsGroup.h"
+
+#include "oops/mpi/mpi.h"
+#include "oops/runs/Application.h"
+#include "oops/util/Logger.h"
+#include "oops/util/missingValues.h"
+#include "oops/util/TimeWindow.h"
+
+#include "common/iodareader.h"
+
+#include "./calcstats.h"
+#include "./domains.h"
+#include "./gridbins.h"
+#include "./statfile.h"
+#include "./statregistry.h"
+#include "./timers.h"
+
+namespace dautils {
+  // -----------------------------------------------------------------------------
+  // one entry of "cases": the shape of the synthetic obs space
+  struct BenchCase {
+    std::string name;
+    size_t nlocs = 10000;
+    size_t nchans = 0;          // 0 for a variable without channels
+    size_t ndomains = 4;        // latitude bands, plus the global domain
+    double fillFraction = 0.1;  // values set to the missing value
+    double rejectFraction = 0.2;  // values with a non zero QC flag
+    size_t repeats = 3;         // timings are the best of repeats runs
+    double minLocsPerSecond = 0.0;  // slowest accepted kernel throughput, 0 to not check
+
+    explicit BenchCase(const eckit::Configuration & conf) {
+      conf.get("name", name);
+      conf.get("nlocs", nlocs);
+      if (conf.has("channels")) conf.get("channels", nchans);
+      if (conf.has("domains")) conf.get("domains", ndomains);
+      if (conf.has("fill fraction")) conf.get("fill fraction", fillFraction);
+      if (conf.has("qc rejection fraction")) conf.get("qc rejection fraction", rejectFraction);
+      if (conf.has("repeats")) conf.get("repeats", repeats);
+      if (conf.has("minimum locations per second")) {
+        conf.get("minimum locations per second", minLocsPerSecond);
+      }
+      repeats = std::max<size_t>(1, repeats);
+    }
+  };
+
+  // -----------------------------------------------------------------------------
+  // an IODA shaped obs space held in memory: MetaData latitude, longitude and
+  // dateTime, and ObsValue, ombg and oman with their EffectiveQC flags
+  class SyntheticSource : public ObsSource {
+    public:
+    SyntheticSource(const BenchCase & bench, const uint32_t seed)
+      : nlocs_(bench.nlocs), nchans_(bench.nchans) {
+      std::mt19937 gen(seed);
+      std::uniform_real_distribution<float> uniform(0.0f, 1.0f);
+      std::normal_distribution<float> normal(0.0f, 1.0f);
+      std::vector<float> & lat = floats_["MetaData/latitude"];
+      std::vector<float> & lon = floats_["MetaData/longitude"];
+      lat.resize(nlocs_);
+      lon.resize(nlocs_);
+      seconds_.resize(nlocs_);
+      for (size_t i = 0; i < nlocs_; i++) {
+        lat[i] = -90.0f + 180.0f * uniform(gen);
+        lon[i] = -180.0f + 360.0f * uniform(gen);
+        seconds_[i] = static_cast<int64_t>(21600 * uniform(gen));
+      }
+      const size_t nvals = nlocs_ * std::max<size_t>(1, nchans_);
+      const float fillVal = util::missingValue<float>();
+      std::vector<float> & obs = floats_["ObsValue/" + variable()];
+      std::vector<float> & ombg = floats_["ombg/" + variable()];
+      std::vector<float> & oman = floats_["oman/" + variable()];
+      std::vector<int> & qc = ints_["EffectiveQC/" + variable()];
+      obs.resize(nvals);
+      ombg.resize(nvals);
+      oman.resize(nvals);
+      qc.resize(nvals);
+      for (size_t i = 0; i < nvals; i++) {
+        obs[i] = 250.0f + 5.0f * normal(gen);
+        ombg[i] = 0.2f + 1.5f * normal(gen);
+        oman[i] = 0.6f * ombg[i] + 0.8f * normal(gen);
+        if (uniform(gen) < bench.fillFraction) obs[i] = ombg[i] = oman[i] = fillVal;
+        qc[i] = uniform(gen) < bench.rejectFraction ? 1 : 0;
+      }
+    }
+
+    static std::string variable() { return "brightnessTemperature"; }
+    size_t nlocs() const override { return nlocs_; }
+    void secondsSince(const util::DateTime &, std::vector<int64_t> & seconds) const override {
+      seconds = seconds_;
+    }
+    // values and QC flags of group/variable, nlocs x nchans
+    const std::vector<float> & floats(const std::string & group) const {
+      return floats_.at(group + "/" + variable());
+    }
+    const std::vector<int> & qcflags() const { return ints_.at("EffectiveQC/" + variable()); }
+    const std::vector<float> & metadata(const std::string & name) const {
+      return floats_.at("MetaData/" + name);
+    }
+
+    protected:
+    void read(const std::string & group, const std::string & name,
+              std::vector<float> & values, const std::vector<int> &) const override {
+      values = floats_.at(group + "/" + name);
+    }
+    void read(const std::string & group, const std::string & name,
+              std::vector<int> & values, const std::vector<int> &) const override {
+      values = ints_.at(group + "/" + name);
+    }
+
+    private:
+    size_t nlocs_;
+    size_t nchans_;
+    std::vector<int64_t> seconds_;
+    std::map<std::string, std::vector<float>> floats_;
+    std::map<std::string, std::vector<int>> ints_;
+  };
+
+  // -----------------------------------------------------------------------------
+  // times the phases of ioda-stats on synthetic obs spaces of every size listed in
+  // "cases": mask building, each statistics kernel and StatFile initialize/write,
+  // reported in locations/s and bytes/s. With "check results" every kernel is also
+  // compared with a plain scalar reference and the stat file is read back, so the
+  // benchmark doubles as a regression test. "compare stat files" checks the stat
+  // files of ioda-stats.x runs against each other
+  class IodaStatsBench : public oops::Application {
+    public:
+    explicit IodaStatsBench(const eckit::mpi::Comm & comm = oops::mpi::world())
+      : Application(comm) {}
+    static const std::string classname() {return "dautils::IodaStatsBench";}
+
+    int execute(const eckit::Configuration & fullConfig, bool /*validate*/) const {
+      const util::TimeWindow timeWindow(eckit::LocalConfiguration(fullConfig, "time window"));
+      std::vector<eckit::LocalConfiguration> caseConfs;
+      fullConfig.get("cases", caseConfs);
+      uint32_t seed = 1;
+      if (fullConfig.has("seed")) fullConfig.get("seed", seed);
+      bool check = false;
+      if (fullConfig.has("check results")) fullConfig.get("check results", check);
+      std::string outputDir = ".";
+      if (fullConfig.has("output directory")) fullConfig.get("output directory", outputDir);
+
+      for (const auto & caseConf : caseConfs) {
+        const BenchCase bench(caseConf);
+        runCase(bench, seed, check, timeWindow, outputDir + "/" + bench.name + ".nc");
+      }
+      if (fullConfig.has("streaming check")) {
+        runStreamingCheck(eckit::LocalConfiguration(fullConfig, "streaming check"), timeWindow,
+                          outputDir);
+      }
+      std::vector<eckit::LocalConfiguration> comparisons;
+      if (fullConfig.has("compare stat files")) fullConfig.get("compare stat files", comparisons);
+      for (const auto & comparison : comparisons) compareStatFiles(comparison);
+      return 0;
+    }
+
+    // -----------------------------------------------------------------------------
+    void runCase(const BenchCase & bench, const uint32_t seed, const bool check,
+                 const util::TimeWindow & timeWindow, const std::string & outfile) const {
+      oops::Log::info() << "IodaStatsBench: " << bench.name << ": nlocs=" << bench.nlocs
+                        << " channels=" << bench.nchans << " domains=" << bench.ndomains
+                        << " fill=" << bench.fillFraction << " reject=" << bench.rejectFraction
+                        << std::endl;
+      const SyntheticSource source(bench, seed);
+      const size_t width = std::max<size_t>(1, bench.nchans);
+      const size_t nvals = bench.nlocs * width;
+      const std::vector<float> & obs = source.floats("ObsValue");
+      const std::vector<float> & ombg = source.floats("ombg");
+      const std::vector<float> & oman = source.floats("oman");
+      const std::vector<int> & qc = source.qcflags();
+      const std::vector<Domain> domains = latitudeBands(bench.ndomains);
+      const size_t ndomains = domains.size() + 1;
+      // bytes a kernel goes through: the values and QC flags once
+      const double kernelBytes = nvals * (sizeof(float) + sizeof(int));
+
+      DomainMasks masks(0, 0);
+      report(bench, "domain masks", bench.nlocs, bench.nlocs * sizeof(float), [&] {
+        masks = computeDomainMasks(source, domains);
+      });
+      const std::vector<const MaskWord *> domainMasks = masks.domains();
+
+      const std::vector<std::string> statNames = {"count", "mean", "RMS", "variance", "stddev",
+                                                  "min", "max", "quantiles", "histogram"};
+      // one degree bins over three standard deviations of ObsValue, their edges
+      // and the values above and below them are exact in float
+      DistributionConfig distConf;
+      distConf.histogramMin = 235.0f;
+      distConf.histogramMax = 265.0f;
+      distConf.histogramBins = 30;
+      const StatPlan plan(statNames, distConf);
+      const ObsStats obstat;
+      std::vector<StatAccumulator> accs;
+      report(bench, "moments", bench.nlocs, kernelBytes, [&] {
+        accs.assign(ndomains * width, StatAccumulator());
+        obstat.accumulateDomains(obs, qc, domainMasks, bench.nchans, kNeedAll, accs.data());
+      }, true);
+      std::vector<StatAccumulator> counts;
+      report(bench, "counts", bench.nlocs, kernelBytes, [&] {
+        counts.assign(ndomains * width, StatAccumulator());
+        obstat.accumulateDomains(obs, qc, domainMasks, bench.nchans, kNeedCount,
+                                 counts.data());
+      }, true);
+      std::vector<StatAccumulator> distAccs;
+      std::vector<Distribution> dists;
+      report(bench, "moments+distribution", bench.nlocs, kernelBytes, [&] {
+        distAccs.assign(ndomains * width, StatAccumulator());
+        dists.assign(ndomains * width, plan.distribution());
+        obstat.accumulateDomains(obs, qc, domainMasks, bench.nchans, plan.needs(),
+                                 distAccs.data(), dists.data());
+      });
+      std::vector<PairAccumulator> pairs;
+      report(bench, "paired", bench.nlocs, 2 * kernelBytes, [&] {
+        pairs.assign(ndomains * width, PairAccumulator());
+        obstat.accumulatePairs(ombg, qc, oman, qc, domainMasks, bench.nchans, pairs.data());
+      }, true);
+      // 2.5 degree map
+      const size_t nlat = 72, nlon = 144;
+      std::vector<int32_t> cells(bench.nlocs);
+      const std::vector<float> & lat = source.metadata("latitude");
+      const std::vector<float> & lon = source.metadata("longitude");
+      for (size_t i = 0; i < bench.nlocs; i++) {
+        const size_t row = std::min(nlat - 1, static_cast<size_t>((lat[i] + 90.0f) / 2.5f));
+        const size_t col = std::min(nlon - 1, static_cast<size_t>((lon[i] + 180.0f) / 2.5f));
+        cells[i] = static_cast<int32_t>(row * nlon + col);
+      }
+      std::vector<StatAccumulator> gridAccs;
+      report(bench, "gridded", bench.nlocs, kernelBytes, [&] {
+        GridAccumulator gridAcc(nlat * nlon, bench.nchans, util::missingValue<float>());
+        gridAccs.assign(nlat * nlon * width, StatAccumulator());
+        gridAcc.accumulate(obs, qc, cells, gridAccs.data());
+      });
+
+      // the statistics of every domain written to a stat file, as ioda-stats does
+      std::vector<int> channels;
+      for (size_t c = 0; c < bench.nchans; c++) channels.push_back(c + 1);
+      std::vector<std::string> domainNames;
+      for (const Domain & domain : domains) domainNames.push_back(domain.name);
+      const std::vector<std::string> groups = {"ObsValue"};
+      const std::vector<std::string> variables = {SyntheticSource::variable()};
+      size_t statWidth = 0;
+      for (const StatEntry & stat : plan.entries()) statWidth += stat.width();
+      const double fileBytes = static_cast<double>(ndomains) * width * sizeof(float) * statWidth;
+      report(bench, "StatFile", ndomains * width, fileBytes, [&] {
+        StatFile statfile;
+        statfile.initializeNcfile(outfile, timeWindow, variables, channels, groups, plan,
+                                  domainNames);
+        for (size_t idom = 0; idom < ndomains; idom++) {
+          const std::vector<StatAccumulator> domAccs(distAccs.begin() + idom * width,
+                                                     distAccs.begin() + (idom + 1) * width);
+          const std::vector<Distribution> domDists(dists.begin() + idom * width,
+                                                   dists.begin() + (idom + 1) * width);
+          std::vector<int> intstat;
+          std::vector<float> floatstat;
+          for (const StatEntry & stat : plan.entries()) {
+            stat.finalize(domAccs, domDists, plan.distributionConfig(),
+                          util::missingValue<float>(), intstat, floatstat);
+            if (stat.integer) {
+              statfile.write(groups[0], variables[0], stat.name, idom, intstat);
+            } else {
+              statfile.write(groups[0], variables[0], stat.name, idom, floatstat);
+            }
+          }
+        }
+        statfile.close();
+      });
+
+      if (!check) return;
+      checkMoments(bench, obs, qc, masks, accs, counts, distAccs);
+      checkDistributions(bench, obs, qc, masks, dists, plan.distributionConfig());
+      checkPairs(bench, ombg, oman, qc, masks, pairs);
+      checkGrid(bench, obs, qc, cells, gridAccs, accs.data() + domains.size() * width);
+      checkFile(bench, outfile, ndomains, distAccs, dists, plan.distributionConfig());
+      oops::Log::info() << "IodaStatsBench: " << bench.name << ": results match the reference"
+                        << std::endl;
+    }
+
+    // -----------------------------------------------------------------------------
+    // "streaming check": IODA files of every size in "nlocs", smallest first, are
+    // streamed "locations per block" at a time with IodaReader through the masks and
+    // kernels. The peak RSS of the process must not grow by more than "maximum peak
+    // rss growth" bytes from the smallest file to the biggest, as it would if any
+    // buffer were sized for the whole file
+    void runStreamingCheck(const eckit::Configuration & conf, const util::TimeWindow & timeWindow,
+                           const std::string & outputDir) const {
+      std::vector<size_t> sizes;
+      conf.get("nlocs", sizes);
+      std::sort(sizes.begin(), sizes.end());
+      size_t blockLocs = 50000;
+      if (conf.has("locations per block")) conf.get("locations per block", blockLocs);
+      double maxGrowth = 0.0;
+      conf.get("maximum peak rss growth", maxGrowth);
+      const std::vector<Domain> domains = latitudeBands(4);
+
+      double baseline = 0.0;
+      for (const size_t nlocs : sizes) {
+        const std::string filename = outputDir + "/iodastats_stream_" + std::to_string(nlocs)
+                                     + ".nc";
+        writeStreamingFile(filename, nlocs, blockLocs, timeWindow);
+        eckit::LocalConfiguration obsConf;
+        obsConf.set("obsdatain.engine.type", "H5File");
+        obsConf.set("obsdatain.engine.obsfile", filename);
+        IodaReader reader(obsConf, timeWindow, oops::mpi::myself());
+
+        const ObsStats obstat;
+        std::vector<StatAccumulator> accs(domains.size() + 1);
+        std::vector<float> values;
+        std::vector<int> qc;
+        for (size_t first = 0; first < reader.sliceSize(); first += blockLocs) {
+          reader.selectLocations(first, std::min(blockLocs, reader.sliceSize() - first));
+          const DomainMasks masks = computeDomainMasks(reader, domains);
+          reader.get_db("ObsValue", SyntheticSource::variable(), values);
+          reader.get_db("EffectiveQC", SyntheticSource::variable(), qc);
+          obstat.accumulateDomains(values, qc, masks.domains(), 0, kNeedAll, accs.data());
+        }
+        if (accs.back().count != static_cast<int64_t>(nlocs)) {
+          throw eckit::Exception("IodaStatsBench: streaming " + filename + " counted "
+                                 + std::to_string(accs.back().count) + " locations");
+        }
+
+        const double peak = PhaseTimers::peakRSS();
+        if (nlocs == sizes.front()) baseline = peak;
+        oops::Log::info() << "IodaStatsBench: streaming " << nlocs << " locations in blocks of "
+                          << blockLocs << ": peak RSS " << peak << " bytes, "
+                          << peak - baseline << " above the smallest file" << std::endl;
+        if (peak - baseline > maxGrowth) {
+          throw eckit::Exception("IodaStatsBench: peak RSS grows with the number of locations "
+                                 "when streaming");
+        }
+      }
+    }
+
+    // -----------------------------------------------------------------------------
+    // one entry of "compare stat files": every numeric variable of the stat file
+    // "reference" against the same variable of "test", at cycle "reference cycle" and
+    // "test cycle" (default 0) of analysisCycle, within a "relative tolerance"
+    // (default 1e-5). Statistics of ioda-stats.x run through other readers, block sizes
+    // or rank counts only differ by the order of their floating point sums
+    void compareStatFiles(const eckit::Configuration & conf) const {
+      const std::string reference = conf.getString("reference");
+      const std::string test = conf.getString("test");
+      size_t referenceCycle = 0, testCycle = 0;
+      if (conf.has("reference cycle")) conf.get("reference cycle", referenceCycle);
+      if (conf.has("test cycle")) conf.get("test cycle", testCycle);
+      double tolerance = 1.0e-5;
+      if (conf.has("relative tolerance")) conf.get("relative tolerance", tolerance);
+      const netCDF::NcFile referenceFile(reference, netCDF::NcFile::read);
+      const netCDF::NcFile testFile(test, netCDF::NcFile::read);
+      const size_t nvars = compareGroups(referenceFile, testFile, "", referenceCycle, testCycle,
+                                         tolerance, test);
+      oops::Log::info() << "IodaStatsBench: " << test << " cycle " << testCycle << " matches "
+                        << reference << " cycle " << referenceCycle << " in " << nvars
+                        << " variables" << std::endl;
+    }
+
+    private:
+    // the variables of group reference and its subgroups compared with those of test,
+    // returns how many were compared
+    static size_t compareGroups(const netCDF::NcGroup & reference, const netCDF::NcGroup & test,
+                                const std::string & path, const size_t referenceCycle,
+                                const size_t testCycle, const double tolerance,
+                                const std::string & testFile) {
+      size_t nvars = 0;
+      for (const auto & entry : reference.getVars()) {
+        const netCDF::NcVar & refVar = entry.second;
+        const std::string name = path + entry.first;
+        const netCDF::NcType::ncType type = refVar.getType().getTypeClass();
+        if (type == netCDF::NcType::nc_STRING || type == netCDF::NcType::nc_CHAR) continue;
+        const netCDF::NcVar testVar = test.getVar(entry.first);
+        if (testVar.isNull()) {
+          throw eckit::Exception("IodaStatsBench: " + testFile + " has no " + name);
+        }
+        std::vector<size_t> refStart, testStart, counts;
+        size_t size = 1;
+        for (const netCDF::NcDim & dim : refVar.getDims()) {
+          const bool cycle = dim.getName() == "analysisCycle";
+          refStart.push_back(cycle ? referenceCycle : 0);
+          testStart.push_back(cycle ? testCycle : 0);
+          counts.push_back(cycle ? 1 : dim.getSize());
+          size *= counts.back();
+        }
+        const std::vector<netCDF::NcDim> testDims = testVar.getDims();
+        bool sameShape = testDims.size() == counts.size();
+        for (size_t d = 0; sameShape && d < counts.size(); d++) {
+          sameShape = testStart[d] + counts[d] <= testDims[d].getSize()
+                      && (refVar.getDim(d).getName() == "analysisCycle"
+                          || testDims[d].getSize() == counts[d]);
+        }
+        if (!sameShape) {
+          throw eckit::Exception("IodaStatsBench: " + name + " of " + testFile
+                                 + " does not have the shape of the reference");
+        }
+        std::vector<double> refValues(size), testValues(size);
+        refVar.getVar(refStart, counts, refValues.data());
+        testVar.getVar(testStart, counts, testValues.data());
+        for (size_t i = 0; i < size; i++) {
+          const double a = refValues[i], b = testValues[i];
+          if (std::fabs(a - b) > tolerance * std::max(std::fabs(a), std::fabs(b))) {
+            std::ostringstream os;
+            os << "IodaStatsBench: " << name << "[" << i << "] of " << testFile << " is " << b
+               << ", the reference is " << a;
+            throw eckit::Exception(os.str());
+          }
+        }
+        nvars++;
+      }
+      for (const auto & entry : reference.getGroups()) {
+        const netCDF::NcGroup testGroup = test.getGroup(entry.first);
+        if (testGroup.isNull()) {
+          throw eckit::Exception("IodaStatsBench: " + testFile + " has no group " + path
+                                 + entry.first);
+        }
+        nvars += compareGroups(entry.second, testGroup, path + entry.first + "/",
+                               referenceCycle, testCycle, tolerance, testFile);
+      }
+      return nvars;
+    }
+
+    // IODA file of nlocs locations inside the time window, written blockLocs at a time in
+    // chunks of blockLocs locations: MetaData/dateTime, latitude and longitude, and
+    // ObsValue and EffectiveQC of one variable, every value valid
+    static void writeStreamingFile(const std::string & filename, const size_t nlocs,
+                                   const size_t blockLocs, const util::TimeWindow & timeWindow) {
+      ioda::Engines::BackendCreationParameters backendParams;
+      backendParams.fileName = filename;
+      backendParams.createMode = ioda::Engines::BackendCreateModes::Truncate_If_Exists;
+      backendParams.action = ioda::Engines::BackendFileActions::Create;
+      backendParams.flush = true;
+      ioda::Group file = ioda::Engines::constructBackend(ioda::Engines::BackendNames::Hdf5File,
+                                                         backendParams);
+      const ioda::Dimensions_t total = nlocs, chunk = std::min(nlocs, blockLocs);
+      ioda::NewDimensionScales_t newDims;
+      newDims.push_back(ioda::NewDimensionScale<int>("Location", total, total, chunk));
+      ioda::ObsGroup og = ioda::ObsGroup::generate(file, newDims);
+      const std::vector<ioda::Variable> scales = {og.vars["Location"]};
+      ioda::VariableCreationParameters params;
+      params.chunk = true;
+      ioda::Variable dateTime = og.vars.createWithScales<int64_t>("MetaData/dateTime", scales,
+                                                                  params);
+      dateTime.atts.add<std::string>("units", std::string("seconds since 1970-01-01T00:00:00Z"));
+      ioda::Variable lat = og.vars.createWithScales<float>("MetaData/latitude", scales, params);
+      ioda::Variable lon = og.vars.createWithScales<float>("MetaData/longitude", scales, params);
+      ioda::Variable obs = og.vars.createWithScales<float>(
+          "ObsValue/" + SyntheticSource::variable(), scales, params);
+      ioda::Variable qc = og.vars.createWithScales<int>(
+          "EffectiveQC/" + SyntheticSource::variable(), scales, params);
+
+      const int64_t midpoint = (timeWindow.midpoint() - util::DateTime(1970, 1, 1, 0, 0, 0))
+                               .toSeconds();
+      std::vector<int64_t> seconds;
+      std::vector<float> lats, lons, values;
+      std::vector<int> flags;
+      for (size_t first = 0; first < nlocs; first += blockLocs) {
+        const size_t count = std::min(blockLocs, nlocs - first);
+        seconds.assign(count, midpoint);
+        flags.assign(count, 0);
+        lats.resize(count);
+        lons.resize(count);
+        values.resize(count);
+        for (size_t i = 0; i < count; i++) {
+          const size_t loc = first + i;
+          lats[i] = -89.5f + static_cast<float>((loc * 7919) % 179);
+          lons[i] = -179.5f + static_cast<float>((loc * 104729) % 359);
+          values[i] = 250.0f + static_cast<float>(loc % 100) * 0.1f;
+        }
+        const ioda::Dimensions_t start = first, n = count;
+        ioda::Selection fileSelection;
+        fileSelection.extent({total}).select({ioda::SelectionOperator::SET, {start}, {n}});
+        ioda::Selection memSelection;
+        memSelection.extent({n}).select({ioda::SelectionOperator::SET, {0}, {n}});
+        dateTime.write<int64_t>(gsl::make_span(seconds.data(), count), memSelection,
+                                fileSelection);
+        lat.write<float>(gsl::make_span(lats.data(), count), memSelection, fileSelection);
+        lon.write<float>(gsl::make_span(lons.data(), count), memSelection, fileSelection);
+        obs.write<float>(gsl::make_span(values.data(), count), memSelection, fileSelection);
+        qc.write<int>(gsl::make_span(flags.data(), count), memSelection, fileSelection);
+      }
+    }
+
+    // ndomains latitude bands of the same width
+    static std::vector<Domain> latitudeBands(const size_t ndomains) {
+      std::vector<Domain> domains;
+      for (size_t idom = 0; idom < ndomains; idom++) {
+        const double lo = -90.0 + 180.0 * idom / ndomains;
+        const double hi = -90.0 + 180.0 * (idom + 1) / ndomains;
+        eckit::LocalConfiguration conf;
+        conf.set("name", "band" + std::to_string(idom));
+        conf.set("first mask variable", "latitude");
+        conf.set("first mask range", std::vector<double>{lo, hi});
+        domains.emplace_back(conf);
+      }
+      return domains;
+    }
+
+    // best time of bench.repeats runs of phase, logged with the throughput.
+    // kernels timed with checkSpeed fail the run below "minimum locations per second"
+    template <typename Phase>
+    static void report(const BenchCase & bench, const std::string & name, const double nlocs,
+                       const double bytes, Phase phase, const bool checkSpeed = false) {
+      double best = 0.0;
+      for (size_t r = 0; r < bench.repeats; r++) {
+        const auto start = std::chrono::steady_clock::now();
+        phase();
+        const std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+        if (r == 0 || elapsed.count() < best) best = elapsed.count();
+      }
+      best = std::max(best, 1.0e-9);
+      oops::Log::info() << "IodaStatsBench: " << bench.name << ": " << std::setw(18) << name
+                        << std::scientific << std::setprecision(3)
+                        << "  time " << best << " s  " << nlocs / best << " locations/s  "
+                        << bytes / best << " bytes/s" << std::defaultfloat << std::endl;
+      if (checkSpeed && bench.minLocsPerSecond > 0.0 && nlocs / best < bench.minLocsPerSecond) {
+        throw eckit::Exception("IodaStatsBench: " + bench.name + ": " + name + " is slower than "
+                               + std::to_string(bench.minLocsPerSecond) + " locations/s");
+      }
+    }
+
+    static void expect(const bool ok, const BenchCase & bench, const std::string & what) {
+      if (!ok) throw eckit::Exception("IodaStatsBench: " + bench.name + ": " + what
+                                      + " differs from the reference");
+    }
+    static bool close(const double a, const double b) {
+      return std::fabs(a - b) <= 1.0e-9 * std::max(1.0, std::max(std::fabs(a), std::fabs(b)));
+    }
+
+    // plain two pass reference of every domain and channel
+    static void checkMoments(const BenchCase & bench, const std::vector<float> & data,
+                             const std::vector<int> & qc, const DomainMasks & masks,
+                             const std::vector<StatAccumulator> & accs,
+                             const std::vector<StatAccumulator> & counts,
+                             const std::vector<StatAccumulator> & distAccs) {
+      const size_t width = std::max<size_t>(1, bench.nchans);
+      const float fillVal = util::missingValue<float>();
+      for (size_t idom = 0; idom < accs.size() / width; idom++) {
+        const MaskWord * mask = masks.domain(idom);
+        for (size_t c = 0; c < width; c++) {
+          int64_t n = 0;
+          double sum = 0.0;
+          float mn = std::numeric_limits<float>::max();
+          float mx = std::numeric_limits<float>::lowest();
+          for (size_t i = 0; i < bench.nlocs; i++) {
+            const float x = data[i * width + c];
+            if (((mask[i / kMaskWordBits] >> (i % kMaskWordBits)) & 1) == 0) continue;
+            if (x == fillVal || qc[i * width + c] != 0) continue;
+            n++;
+            sum += x;
+            mn = std::min(mn, x);
+            mx = std::max(mx, x);
+          }
+          const double mean = n > 0 ? sum / n : 0.0;
+          double m2 = 0.0;
+          for (size_t i = 0; i < bench.nlocs; i++) {
+            const float x = data[i * width + c];
+            if (((mask[i / kMaskWordBits] >> (i % kMaskWordBits)) & 1) == 0) continue;
+            if (x == fillVal || qc[i * width + c] != 0) continue;
+            m2 += (x - mean) * (x - mean);
+          }
+          const StatAccumulator & acc = accs[idom * width + c];
+          expect(acc.count == n && counts[idom * width + c].count == n
+                 && distAccs[idom * width + c].count == n, bench, "count");
+          if (n == 0) continue;
+          expect(close(acc.mean(), mean) && close(distAccs[idom * width + c].mean(), mean),
+                 bench, "mean");
+          expect(std::fabs(acc.variance() - m2 / n) <= 1.0e-6 * std::max(1.0, m2 / n), bench,
+                 "variance");
+          expect(acc.min == mn && acc.max == mx, bench, "min/max");
+        }
+      }
+    }
+
+    // quantiles of the sketch against the sorted values of every domain and channel:
+    // the rank of each one is within the rank error of the sketch of the exact rank.
+    // histogram counts against a direct count over the bins
+    static void checkDistributions(const BenchCase & bench, const std::vector<float> & data,
+                                   const std::vector<int> & qc, const DomainMasks & masks,
+                                   const std::vector<Distribution> & dists,
+                                   const DistributionConfig & conf) {
+      const size_t width = std::max<size_t>(1, bench.nchans);
+      const float fillVal = util::missingValue<float>();
+      const double binWidth = (conf.histogramMax - conf.histogramMin) / conf.histogramBins;
+      std::vector<float> sorted;
+      std::vector<int64_t> binCounts;
+      for (size_t idom = 0; idom < dists.size() / width; idom++) {
+        const MaskWord * mask = masks.domain(idom);
+        for (size_t c = 0; c < width; c++) {
+          sorted.clear();
+          binCounts.assign(conf.histogramBins, 0);
+          for (size_t i = 0; i < bench.nlocs; i++) {
+            const float x = data[i * width + c];
+            if (((mask[i / kMaskWordBits] >> (i % kMaskWordBits)) & 1) == 0) continue;
+            if (x == fillVal || qc[i * width + c] != 0) continue;
+            sorted.push_back(x);
+            const double bin = std::floor((x - conf.histogramMin) / binWidth);
+            binCounts[static_cast<size_t>(std::min(std::max(bin, 0.0),
+                                                   conf.histogramBins - 1.0))]++;
+          }
+          std::sort(sorted.begin(), sorted.end());
+          const Distribution & dist = dists[idom * width + c];
+          const double n = sorted.size();
+          expect(dist.sketch.count() == static_cast<int64_t>(n), bench, "quantile sketch count");
+          const std::vector<float> quantiles = dist.sketch.quantiles(conf.levels, fillVal);
+          for (size_t q = 0; q < conf.levels.size(); q++) {
+            if (sorted.empty()) {
+              expect(quantiles[q] == fillVal, bench, "quantile of an empty domain");
+              continue;
+            }
+            // ranks of the values equal to the estimate
+            const double lower = std::lower_bound(sorted.begin(), sorted.end(), quantiles[q])
+                                 - sorted.begin();
+            const double upper = std::upper_bound(sorted.begin(), sorted.end(), quantiles[q])
+                                 - sorted.begin();
+            const double target = conf.levels[q] * n;
+            const double error = std::max(0.0, std::max(lower - target, target - upper));
+            expect(error <= dist.sketch.rankError() * n + 1.0, bench,
+                   "quantile " + std::to_string(conf.levels[q]));
+          }
+          expect(dist.histogram.counts() == binCounts, bench, "histogram");
+        }
+      }
+    }
+
+    static void checkPairs(const BenchCase & bench, const std::vector<float> & x,
+                           const std::vector<float> & y, const std::vector<int> & qc,
+                           const DomainMasks & masks, const std::vector<PairAccumulator> & pairs) {
+      const size_t width = std::max<size_t>(1, bench.nchans);
+      const float fillVal = util::missingValue<float>();
+      for (size_t idom = 0; idom < pairs.size() / width; idom++) {
+        const MaskWord * mask = masks.domain(idom);
+        for (size_t c = 0; c < width; c++) {
+          int64_t n = 0;
+          double sumx = 0.0, sumy = 0.0, sumxy = 0.0;
+          for (size_t i = 0; i < bench.nlocs; i++) {
+            const size_t j = i * width + c;
+            if (((mask[i / kMaskWordBits] >> (i % kMaskWordBits)) & 1) == 0) continue;
+            if (x[j] == fillVal || y[j] == fillVal || qc[j] != 0) continue;
+            n++;
+            sumx += x[j];
+            sumy += y[j];
+            sumxy += static_cast<double>(x[j]) * y[j];
+          }
+          const PairAccumulator & acc = pairs[idom * width + c];
+          expect(acc.count == n, bench, "paired count");
+          if (n == 0) continue;
+          expect(close(acc.crossProduct(), sumxy / n), bench, "cross product");
+          expect(std::fabs(acc.covariance() - (sumxy / n - sumx * sumy / n / n)) <= 1.0e-6,
+                 bench, "covariance");
+        }
+      }
+    }
+
+    // the cells cover every location, so they add up to the global domain
+    static void checkGrid(const BenchCase & bench, const std::vector<float> & data,
+                          const std::vector<int> & qc, const std::vector<int32_t> & cells,
+                          const std::vector<StatAccumulator> & gridAccs,
+                          const StatAccumulator * global) {
+      const size_t width = std::max<size_t>(1, bench.nchans);
+      for (size_t c = 0; c < width; c++) {
+        StatAccumulator total;
+        for (size_t cell = 0; cell < gridAccs.size() / width; cell++) {
+          total.merge(gridAccs[cell * width + c]);
+        }
+        expect(total.count == global[c].count, bench, "gridded count");
+        expect(total.count == 0 || (total.min == global[c].min && total.max == global[c].max),
+               bench, "gridded min/max");
+        expect(std::fabs(total.mean() - global[c].mean()) <= 1.0e-9 * 250.0, bench,
+               "gridded mean");
+      }
+    }
+
+    // the stat file holds the count, mean, quantiles and histogram of every domain
+    // and channel
+    static void checkFile(const BenchCase & bench, const std::string & outfile,
+                          const size_t ndomains, const std::vector<StatAccumulator> & accs,
+                          const std::vector<Distribution> & dists,
+                          const DistributionConfig & conf) {
+      const size_t width = std::max<size_t>(1, bench.nchans);
+      const size_t nlevels = conf.levels.size();
+      const size_t nbins = conf.histogramBins;
+      netCDF::NcFile file(outfile, netCDF::NcFile::read);
+      netCDF::NcGroup group = file.getGroup("ObsValue").getGroup(SyntheticSource::variable());
+      std::vector<int> counts(ndomains * width);
+      std::vector<float> means(ndomains * width);
+      std::vector<float> quantiles(ndomains * width * nlevels);
+      std::vector<int> histograms(ndomains * width * nbins);
+      group.getVar("count").getVar(counts.data());
+      group.getVar("mean").getVar(means.data());
+      group.getVar("quantiles").getVar(quantiles.data());
+      group.getVar("histogram").getVar(histograms.data());
+      const float fillVal = util::missingValue<float>();
+      for (size_t k = 0; k < accs.size(); k++) {
+        expect(counts[k] == accs[k].count, bench, "stat file count");
+        expect(means[k] == static_cast<float>(accs[k].mean()), bench, "stat file mean");
+        const std::vector<float> values = dists[k].sketch.quantiles(conf.levels, fillVal);
+        expect(std::equal(values.begin(), values.end(), quantiles.begin() + k * nlevels), bench,
+               "stat file quantiles");
+        const std::vector<int64_t> & binCounts = dists[k].histogram.counts();
+        expect(std::equal(binCounts.begin(), binCounts.end(), histograms.begin() + k * nbins),
+               bench, "stat file histogram");
+      }
+    }
+  };
+}  // namespace dautils
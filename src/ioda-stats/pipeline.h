@@ -0,0 +1,107 @@
+#pragma once
+
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace dautils {
+  // -----------------------------------------------------------------------------
+  // arrays of one (group, variable) read, or of both groups of a pair, held by an
+  // ArrayCache which reuses their memory from one read to the next
+  struct ReadBuffers {
+    const std::vector<float> * values = nullptr;
+    const std::vector<int> * qcflags = nullptr;
+    const std::vector<float> * values2 = nullptr;
+    const std::vector<int> * qcflags2 = nullptr;
+  };
+
+  // -----------------------------------------------------------------------------
+  // runs read(0) ... read(ntasks - 1) on a reader thread, each into a free slot of
+  // pool, while the caller works on the previous ones: with a pool of two
+  // the next variable is read while the current one is reduced. Reads are handed
+  // out in order and a slot goes back to the pool on the next call to next().
+  // Only the reader thread reads while the pipeline is alive
+  class ReadPipeline {
+    public:
+    using ReadFunction = std::function<void(size_t, ReadBuffers &)>;
+
+    ReadPipeline(std::vector<ReadBuffers> & pool, const size_t ntasks, ReadFunction read)
+      : ntasks_(ntasks), read_(std::move(read)) {
+      for (ReadBuffers & buffers : pool) free_.push_back(&buffers);
+      reader_ = std::thread([this] { run(); });
+    }
+
+    ~ReadPipeline() {
+      {
+        std::lock_guard<std::mutex> lock(mutex_);
+        stop_ = true;
+      }
+      changed_.notify_all();
+      reader_.join();
+    }
+
+    ReadPipeline(const ReadPipeline &) = delete;
+    ReadPipeline & operator=(const ReadPipeline &) = delete;
+
+    // buffers of the next task in order, nullptr after the last one.
+    // an exception thrown by read is thrown again here
+    ReadBuffers * next() {
+      std::unique_lock<std::mutex> lock(mutex_);
+      if (current_ != nullptr) {
+        free_.push_back(current_);
+        current_ = nullptr;
+        changed_.notify_all();
+      }
+      if (handedOut_ == ntasks_) return nullptr;
+      changed_.wait(lock, [this] { return !ready_.empty() || error_; });
+      if (error_) std::rethrow_exception(error_);
+      current_ = ready_.front();
+      ready_.pop_front();
+      handedOut_++;
+      return current_;
+    }
+
+    private:
+    void run() {
+      for (size_t task = 0; task < ntasks_; task++) {
+        ReadBuffers * buffers;
+        {
+          std::unique_lock<std::mutex> lock(mutex_);
+          changed_.wait(lock, [this] { return !free_.empty() || stop_; });
+          if (stop_) return;
+          buffers = free_.front();
+          free_.pop_front();
+        }
+        try {
+          read_(task, *buffers);
+        } catch (...) {
+          std::lock_guard<std::mutex> lock(mutex_);
+          error_ = std::current_exception();
+          changed_.notify_all();
+          return;
+        }
+        {
+          std::lock_guard<std::mutex> lock(mutex_);
+          ready_.push_back(buffers);
+        }
+        changed_.notify_all();
+      }
+    }
+
+    const size_t ntasks_;
+    ReadFunction read_;
+    std::mutex mutex_;
+    std::condition_variable changed_;
+    std::deque<ReadBuffers *> free_;
+    std::deque<ReadBuffers *> ready_;
+    ReadBuffers * current_ = nullptr;
+    size_t handedOut_ = 0;
+    bool stop_ = false;
+    std::exception_ptr error_;
+    std::thread reader_;
+  };
+}  // namespace dautils
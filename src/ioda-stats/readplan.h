@@ -0,0 +1,231 @@
+#pragma once
+
+#include <array>
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+#include "eckit/exception/Exceptions.h"
+
+#include "oops/util/DateTime.h"
+
+#include "common/iodareader.h"
+
+namespace dautils {
+  // -----------------------------------------------------------------------------
+  // two groups of the same variables compared by the paired statistics, name is
+  // the combined group they are written under
+  struct GroupPair {
+    std::string name;
+    std::array<std::string, 2> groups;
+    std::array<std::string, 2> qcgroups;
+  };
+
+  // -----------------------------------------------------------------------------
+  // every array an obs space needs, listed before anything is read: each
+  // (variable, group) task uses its values and its QC flags, each (variable, pair)
+  // task those of both groups, and arrays shared by several tasks (typically the
+  // QC group of ObsValue, ombg and oman, or a group also in a pair) appear once.
+  // The MetaData used by the domain masks and the bins are added as users of
+  // their arrays too, so a coordinate used by several of them is read once
+  class ReadPlan {
+    public:
+    // what an array holds and how it is read
+    enum class Kind {
+      Values,     // float, over the channels of the obs space
+      QcFlags,    // int, over the channels of the obs space
+      MetaData,   // float, one value per location
+      Seconds     // MetaData/dateTime in seconds from the start of the time window
+    };
+    struct Array {
+      std::string group;
+      std::string variable;
+      Kind kind;
+      size_t users;    // number of tasks, masks and bins using it
+    };
+    struct Task {
+      size_t variable;   // index in the variables
+      size_t group;      // index in the groups, or in the pairs when paired
+      bool paired;
+      size_t values;     // index in arrays()
+      size_t qcflags;
+      size_t values2;    // second group of a pair
+      size_t qcflags2;
+    };
+
+    ReadPlan() = default;
+    // tasks in the order of the variables, then the groups followed by the pairs
+    ReadPlan(const std::vector<std::string> & variables, const std::vector<std::string> & groups,
+             const std::vector<std::string> & qcgroups,
+             const std::vector<GroupPair> & pairs = {}) {
+      for (size_t var = 0; var < variables.size(); var++) {
+        const std::string & variable = variables[var];
+        for (size_t g = 0; g < groups.size(); g++) {
+          const size_t values = arrayIndex(groups[g], variable, Kind::Values);
+          const size_t qcflags = arrayIndex(qcgroups[g], variable, Kind::QcFlags);
+          tasks_.push_back({var, g, false, values, qcflags, values, qcflags});
+        }
+        for (size_t p = 0; p < pairs.size(); p++) {
+          tasks_.push_back({var, p, true,
+                            arrayIndex(pairs[p].groups[0], variable, Kind::Values),
+                            arrayIndex(pairs[p].qcgroups[0], variable, Kind::QcFlags),
+                            arrayIndex(pairs[p].groups[1], variable, Kind::Values),
+                            arrayIndex(pairs[p].qcgroups[1], variable, Kind::QcFlags)});
+        }
+      }
+    }
+
+    const std::vector<Task> & tasks() const { return tasks_; }
+    const std::vector<Array> & arrays() const { return arrays_; }
+
+    // one more user of MetaData/variable, or of the seconds of MetaData/dateTime
+    size_t addMetaData(const std::string & variable) {
+      return arrayIndex("MetaData", variable, Kind::MetaData);
+    }
+    size_t addSeconds() { return arrayIndex("MetaData", "dateTime", Kind::Seconds); }
+
+    // the array of an earlier add
+    size_t metaData(const std::string & variable) const {
+      return find("MetaData", variable, Kind::MetaData);
+    }
+    size_t seconds() const { return find("MetaData", "dateTime", Kind::Seconds); }
+
+    private:
+    size_t find(const std::string & group, const std::string & variable, const Kind kind) const {
+      for (size_t i = 0; i < arrays_.size(); i++) {
+        if (arrays_[i].group == group && arrays_[i].variable == variable
+            && arrays_[i].kind == kind) {
+          return i;
+        }
+      }
+      throw eckit::BadValue("ReadPlan: " + group + "/" + variable + " was not planned");
+    }
+
+    size_t arrayIndex(const std::string & group, const std::string & variable, const Kind kind) {
+      for (size_t i = 0; i < arrays_.size(); i++) {
+        if (arrays_[i].group == group && arrays_[i].variable == variable
+            && arrays_[i].kind == kind) {
+          arrays_[i].users++;
+          return i;
+        }
+      }
+      arrays_.push_back({group, variable, kind, 1});
+      return arrays_.size() - 1;
+    }
+
+    std::vector<Task> tasks_;
+    std::vector<Array> arrays_;
+  };
+
+  // -----------------------------------------------------------------------------
+  // reference counted arrays of a ReadPlan: an array is read by its first user and
+  // freed by its last one, so every array is read once per block of locations and
+  // only the arrays still needed are held. Freed vectors are kept as spares and
+  // reused by the next reads instead of allocating new ones.
+  // Arrays are read by one thread, released by any. Seconds are counted from start
+  class ArrayCache {
+    public:
+    ArrayCache(const ReadPlan & plan, const ObsSource & source, const std::vector<int> & channels,
+               const util::DateTime & start = util::DateTime())
+      : plan_(plan), source_(source), channels_(channels), start_(start),
+        entries_(plan.arrays().size()) {
+      reset();
+    }
+
+    const ReadPlan & plan() const { return plan_; }
+    const std::vector<float> & floats(const size_t id) { return load(id, floatSpares_).floats; }
+    const std::vector<int> & ints(const size_t id) { return load(id, intSpares_).ints; }
+    const std::vector<int64_t> & seconds(const size_t id) {
+      return load(id, secondsSpares_).seconds;
+    }
+
+    // one user of the array is done with it
+    void release(const size_t id) {
+      std::lock_guard<std::mutex> lock(mutex_);
+      Entry & entry = entries_[id];
+      if (--entry.remaining > 0) return;
+      switch (plan_.arrays()[id].kind) {
+        case ReadPlan::Kind::QcFlags:
+          intSpares_.push_back(std::move(entry.ints));
+          break;
+        case ReadPlan::Kind::Seconds:
+          secondsSpares_.push_back(std::move(entry.seconds));
+          break;
+        default:
+          floatSpares_.push_back(std::move(entry.floats));
+      }
+      entry.loaded = false;
+    }
+
+    // bytes read from the source so far
+    size_t bytesRead() {
+      std::lock_guard<std::mutex> lock(mutex_);
+      return bytesRead_;
+    }
+
+    // every array is needed again, for the next block of locations
+    void reset() {
+      std::lock_guard<std::mutex> lock(mutex_);
+      for (size_t id = 0; id < entries_.size(); id++) {
+        entries_[id].remaining = plan_.arrays()[id].users;
+      }
+    }
+
+    private:
+    struct Entry {
+      std::vector<float> floats;
+      std::vector<int> ints;
+      std::vector<int64_t> seconds;
+      size_t remaining = 0;
+      bool loaded = false;
+    };
+
+    template <typename T>
+    Entry & load(const size_t id, std::vector<std::vector<T>> & spares) {
+      Entry & entry = entries_[id];
+      std::vector<T> values;
+      {
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (entry.loaded) return entry;
+        if (!spares.empty()) {
+          values = std::move(spares.back());
+          spares.pop_back();
+        }
+      }
+      // read without the lock so releases do not wait for the file
+      const ReadPlan::Array & array = plan_.arrays()[id];
+      if constexpr (std::is_same_v<T, int64_t>) {
+        source_.secondsSince(start_, values);
+      } else if (array.kind == ReadPlan::Kind::MetaData) {
+        source_.get_db(array.group, array.variable, values);
+      } else {
+        source_.get_db(array.group, array.variable, values, channels_);
+      }
+      std::lock_guard<std::mutex> lock(mutex_);
+      bytesRead_ += values.size() * sizeof(T);
+      if constexpr (std::is_same_v<T, int>) {
+        entry.ints = std::move(values);
+      } else if constexpr (std::is_same_v<T, int64_t>) {
+        entry.seconds = std::move(values);
+      } else {
+        entry.floats = std::move(values);
+      }
+      entry.loaded = true;
+      return entry;
+    }
+
+    const ReadPlan & plan_;
+    const ObsSource & source_;
+    const std::vector<int> channels_;
+    const util::DateTime start_;
+    std::vector<Entry> entries_;
+    std::vector<std::vector<float>> floatSpares_;
+    std::vector<std::vector<int>> intSpares_;
+    std::vector<std::vector<int64_t>> secondsSpares_;
+    size_t bytesRead_ = 0;
+    std::mutex mutex_;
+  };
+}  // namespace dautils
@@ -0,0 +1,310 @@
+#pragma once
+
+#include <mpi.h>
+#include <netcdf>
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <filesystem>
+#include <fstream>
+#include <map>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "eckit/config/LocalConfiguration.h"
+#include "eckit/exception/Exceptions.h"
+#include "eckit/mpi/Comm.h"
+
+#include "oops/util/Logger.h"
+
+namespace dautils {
+  // -----------------------------------------------------------------------------
+  // regular lat/lon raster of named regions (ocean basins and polygons), each cell
+  // holds one bit per region its center is in, so classifying an observation is a
+  // single table lookup instead of point in polygon tests
+  class RegionRaster {
+    public:
+    using Cell = unsigned long long;
+    static constexpr size_t kMaxRegions = 64;
+
+    RegionRaster() = default;
+
+    // conf is the "regions" section: resolution (degrees), an optional basin file
+    // with lat, lon and basin ids (numbered as in basins), optional polygons, and
+    // an optional cache file the raster is loaded from or saved to.
+    // The raster is built (or loaded) on the first rank of comm and broadcast, so only
+    // one rank ever reads or writes the cache file
+    RegionRaster(const eckit::Configuration & conf, const std::map<std::string, int> & basins,
+                 const eckit::mpi::Comm & comm) {
+      resolution_ = 0.25;
+      if (conf.has("resolution")) {
+        conf.get("resolution", resolution_);
+      }
+      nlat_ = static_cast<size_t>(std::lround(180.0 / resolution_));
+      nlon_ = static_cast<size_t>(std::lround(360.0 / resolution_));
+
+      // region names, basins first in id order then the polygons
+      std::string basinFile;
+      std::vector<std::pair<int, std::string>> basinIds;
+      if (conf.has("basin file")) {
+        conf.get("basin file", basinFile);
+        for (const auto & basin : basins) basinIds.push_back({basin.second, basin.first});
+        std::sort(basinIds.begin(), basinIds.end());
+        for (const auto & basin : basinIds) names_.push_back(basin.second);
+      }
+      std::vector<eckit::LocalConfiguration> polygons;
+      if (conf.has("polygons")) {
+        conf.get("polygons", polygons);
+      }
+      for (const auto & polygon : polygons) {
+        std::string name;
+        polygon.get("name", name);
+        names_.push_back(name);
+      }
+      if (names_.size() > kMaxRegions) {
+        throw eckit::BadValue("RegionRaster: at most 64 regions are supported");
+      }
+
+      std::string latName = "lat", lonName = "lon", basinName = "basin";
+      if (conf.has("basin file latitude")) conf.get("basin file latitude", latName);
+      if (conf.has("basin file longitude")) conf.get("basin file longitude", lonName);
+      if (conf.has("basin file variable")) conf.get("basin file variable", basinName);
+      std::vector<std::vector<double>> polygonLats(polygons.size());
+      std::vector<std::vector<double>> polygonLons(polygons.size());
+      for (size_t p = 0; p < polygons.size(); p++) {
+        polygons[p].get("latitude", polygonLats[p]);
+        polygons[p].get("longitude", polygonLons[p]);
+        if (polygonLats[p].size() != polygonLons[p].size() || polygonLats[p].size() < 3) {
+          throw eckit::BadValue("RegionRaster: polygon " + names_[basinIds.size() + p]
+                                + " needs at least 3 latitude/longitude vertices");
+        }
+      }
+
+      // what the raster is made of, a change in any of it invalidates the cache
+      source_ = fingerprint(basinFile, {latName, lonName, basinName}, polygonLats, polygonLons);
+      cells_.assign(nlat_ * nlon_, 0);
+      if (comm.rank() == 0) {
+        std::string cacheFile;
+        if (conf.has("cache file")) {
+          conf.get("cache file", cacheFile);
+        }
+        if (!cacheFile.empty() && std::ifstream(cacheFile).good()
+            && readCache(cacheFile, source_)) {
+          oops::Log::info() << "RegionRaster: loaded " << cacheFile << std::endl;
+        } else {
+          if (!basinFile.empty()) {
+            rasterizeBasins(basinFile, latName, lonName, basinName, basinIds);
+          }
+          for (size_t p = 0; p < polygons.size(); p++) {
+            rasterizePolygon(polygonLats[p], polygonLons[p], basinIds.size() + p);
+          }
+          oops::Log::info() << "RegionRaster: rasterized " << names_.size() << " regions on a "
+                            << nlat_ << "x" << nlon_ << " grid" << std::endl;
+          if (!cacheFile.empty()) writeCache(cacheFile, source_);
+        }
+      }
+      MPI_Bcast(cells_.data(), static_cast<int>(cells_.size()), MPI_UNSIGNED_LONG_LONG, 0,
+                MPI_Comm_f2c(comm.communicator()));
+    }
+
+    bool empty() const { return cells_.empty(); }
+
+    // fingerprint of the polygons and of the basin file (name, size, modification
+    // time and variables) the raster was made from
+    const std::string & source() const { return source_; }
+
+    // bit of the named region, -1 if there is no such region
+    int regionIndex(const std::string & name) const {
+      const auto it = std::find(names_.begin(), names_.end(), name);
+      return it == names_.end() ? -1 : static_cast<int>(it - names_.begin());
+    }
+
+    Cell lookup(const float lat, const float lon) const {
+      // missing or out of range positions are in no region
+      if (!(lat >= -90.0f && lat <= 90.0f && lon >= -720.0f && lon <= 720.0f)) return 0;
+      const double row = std::floor((lat + 90.0) / resolution_);
+      const double lastRow = static_cast<double>(nlat_) - 1.0;
+      const size_t r = static_cast<size_t>(std::min(std::max(row, 0.0), lastRow));
+      return cells_[r * nlon_ + column(lon)];
+    }
+
+    private:
+    // raster column of a longitude in any convention, the first column starts at -180
+    size_t column(const double lon) const {
+      const long col = static_cast<long>(std::floor((lon + 180.0) / resolution_));
+      const long n = static_cast<long>(nlon_);
+      return static_cast<size_t>(((col % n) + n) % n);
+    }
+
+    double cellLat(const size_t r) const {
+      return -90.0 + (static_cast<double>(r) + 0.5) * resolution_;
+    }
+    double cellLon(const size_t c) const {
+      return -180.0 + (static_cast<double>(c) + 0.5) * resolution_;
+    }
+
+    // nearest basin grid point of each cell center, the basin grid must be regular
+    void rasterizeBasins(const std::string & filename, const std::string & latName,
+                         const std::string & lonName, const std::string & basinName,
+                         const std::vector<std::pair<int, std::string>> & basinIds) {
+      netCDF::NcFile ncFile(filename, netCDF::NcFile::read);
+      netCDF::NcVar latVar = ncFile.getVar(latName);
+      netCDF::NcVar lonVar = ncFile.getVar(lonName);
+      netCDF::NcVar basinVar = ncFile.getVar(basinName);
+      if (latVar.isNull() || lonVar.isNull() || basinVar.isNull()) {
+        throw eckit::BadValue("RegionRaster: " + filename + " needs " + latName + ", "
+                              + lonName + " and " + basinName);
+      }
+      std::vector<double> lats(latVar.getDim(0).getSize());
+      std::vector<double> lons(lonVar.getDim(0).getSize());
+      std::vector<int> ids(lats.size() * lons.size());
+      latVar.getVar(lats.data());
+      lonVar.getVar(lons.data());
+      basinVar.getVar(ids.data());
+      if (lats.size() < 2 || lons.size() < 2) {
+        throw eckit::BadValue("RegionRaster: " + filename + " grid is too small");
+      }
+      const double dlat = (lats.back() - lats.front()) / static_cast<double>(lats.size() - 1);
+      const double dlon = (lons.back() - lons.front()) / static_cast<double>(lons.size() - 1);
+      // a periodic grid (0..359.75 say): the cells just west of its first longitude
+      // are nearest to it, not past the last one
+      const bool global = std::fabs(static_cast<double>(lons.size()) * dlon - 360.0)
+                          < 0.5 * dlon;
+
+      // basin id to region bit
+      std::map<int, Cell> idBits;
+      for (size_t b = 0; b < basinIds.size(); b++) idBits[basinIds[b].first] = Cell(1) << b;
+
+      for (size_t r = 0; r < nlat_; r++) {
+        const long i = std::lround((cellLat(r) - lats.front()) / dlat);
+        if (i < 0 || i >= static_cast<long>(lats.size())) continue;
+        for (size_t c = 0; c < nlon_; c++) {
+          const double offset = std::fmod(cellLon(c) - lons.front() + 720.0, 360.0);
+          long j = std::lround(offset / dlon);
+          if (global) j %= static_cast<long>(lons.size());
+          if (j < 0 || j >= static_cast<long>(lons.size())) continue;
+          const auto bit = idBits.find(ids[i * lons.size() + j]);
+          if (bit != idBits.end()) cells_[r * nlon_ + c] |= bit->second;
+        }
+      }
+    }
+
+    // scanline fill of the cells whose center is inside the polygon, longitudes may
+    // run past 180 (or below -180) for polygons crossing the date line
+    void rasterizePolygon(const std::vector<double> & lats, const std::vector<double> & lons,
+                          const size_t region) {
+      const Cell bit = Cell(1) << region;
+      const size_t nv = lats.size();
+      std::vector<double> crossings;
+      for (size_t r = 0; r < nlat_; r++) {
+        const double y = cellLat(r);
+        crossings.clear();
+        for (size_t v = 0; v < nv; v++) {
+          const size_t w = (v + 1) % nv;
+          if ((lats[v] <= y) != (lats[w] <= y)) {
+            const double t = (y - lats[v]) / (lats[w] - lats[v]);
+            crossings.push_back(lons[v] + t * (lons[w] - lons[v]));
+          }
+        }
+        std::sort(crossings.begin(), crossings.end());
+        for (size_t k = 0; k + 1 < crossings.size(); k += 2) {
+          // first cell center at or east of the crossing
+          double x = -180.0 + (std::ceil((crossings[k] + 180.0) / resolution_ - 0.5) + 0.5)
+                     * resolution_;
+          for (; x < crossings[k + 1]; x += resolution_) {
+            cells_[r * nlon_ + column(x)] |= bit;
+          }
+        }
+      }
+    }
+
+    static std::string joinNames(const std::vector<std::string> & names) {
+      std::ostringstream os;
+      for (size_t n = 0; n < names.size(); n++) os << (n > 0 ? "," : "") << names[n];
+      return os.str();
+    }
+
+    // FNV-1a hash of the polygon vertices, and the name, size and modification time
+    // of the basin file with the names of its variables
+    static std::string fingerprint(const std::string & basinFile,
+                                   const std::vector<std::string> & basinNames,
+                                   const std::vector<std::vector<double>> & lats,
+                                   const std::vector<std::vector<double>> & lons) {
+      uint64_t hash = 14695981039346656037ull;
+      auto add = [&hash](const void * data, const size_t size) {
+        const unsigned char * bytes = static_cast<const unsigned char *>(data);
+        for (size_t i = 0; i < size; i++) {
+          hash ^= bytes[i];
+          hash *= 1099511628211ull;
+        }
+      };
+      for (size_t p = 0; p < lats.size(); p++) {
+        const uint64_t nv = lats[p].size();
+        add(&nv, sizeof(nv));
+        add(lats[p].data(), lats[p].size() * sizeof(double));
+        add(lons[p].data(), lons[p].size() * sizeof(double));
+      }
+      char polygonHash[17];
+      std::snprintf(polygonHash, sizeof(polygonHash), "%016llx",
+                    static_cast<unsigned long long>(hash));
+      std::ostringstream os;
+      os << "polygons " << polygonHash;
+      if (!basinFile.empty()) {
+        std::error_code sizeErr, timeErr;
+        const uintmax_t size = std::filesystem::file_size(basinFile, sizeErr);
+        const auto mtime = std::filesystem::last_write_time(basinFile, timeErr);
+        os << ";basin file " << basinFile << " " << (sizeErr ? 0 : size) << " "
+           << (timeErr ? 0 : mtime.time_since_epoch().count()) << " " << joinNames(basinNames);
+      }
+      return os.str();
+    }
+
+    // false if the cache was made for other regions, another resolution, other
+    // polygon vertices or another basin file
+    bool readCache(const std::string & filename, const std::string & source) {
+      netCDF::NcFile ncFile(filename, netCDF::NcFile::read);
+      netCDF::NcGroupAtt resAtt = ncFile.getAtt("resolution");
+      netCDF::NcGroupAtt namesAtt = ncFile.getAtt("regions");
+      netCDF::NcGroupAtt sourceAtt = ncFile.getAtt("source");
+      if (resAtt.isNull() || namesAtt.isNull() || sourceAtt.isNull()) return false;
+      double resolution;
+      std::string names, fileSource;
+      resAtt.getValues(&resolution);
+      namesAtt.getValues(names);
+      sourceAtt.getValues(fileSource);
+      if (resolution != resolution_ || names != joinNames(names_) || fileSource != source) {
+        return false;
+      }
+      cells_.resize(nlat_ * nlon_);
+      ncFile.getVar("regionBits").getVar(cells_.data());
+      return true;
+    }
+
+    // written to a temporary file then renamed, so the cache file is always complete
+    void writeCache(const std::string & filename, const std::string & source) const {
+      const std::string tmpfile = filename + ".tmp";
+      {
+        netCDF::NcFile ncFile(tmpfile, netCDF::NcFile::replace);
+        netCDF::NcDim latDim = ncFile.addDim("lat", nlat_);
+        netCDF::NcDim lonDim = ncFile.addDim("lon", nlon_);
+        ncFile.putAtt("resolution", netCDF::ncDouble, resolution_);
+        ncFile.putAtt("regions", joinNames(names_));
+        ncFile.putAtt("source", source);
+        netCDF::NcVar bits = ncFile.addVar("regionBits", netCDF::ncUint64, {latDim, lonDim});
+        bits.putVar(cells_.data());
+      }
+      std::filesystem::rename(tmpfile, filename);
+      oops::Log::info() << "RegionRaster: saved " << filename << std::endl;
+    }
+
+    double resolution_ = 0.25;
+    size_t nlat_ = 0;
+    size_t nlon_ = 0;
+    std::vector<std::string> names_;
+    std::vector<Cell> cells_;
+    std::string source_;
+  };
+}  // namespace dautils
@@ -0,0 +1,155 @@
+#pragma once
+
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <iterator>
+#include <sstream>
+#include <string>
+#include <type_traits>
+#include <vector>
+
+#include "eckit/config/LocalConfiguration.h"
+#include "eckit/exception/Exceptions.h"
+
+#include "oops/util/Logger.h"
+#include "oops/util/TimeWindow.h"
+
+#include "./calcstats.h"
+
+namespace dautils {
+  // -----------------------------------------------------------------------------
+  // reduced accumulators of obs spaces kept on disk, so a rerun of a cycle whose
+  // input files have not changed skips reading them. An entry is found by the
+  // fingerprint of its input file (size and modification time) and of everything
+  // the results depend on: the whole obs space entry, the time window, the regions
+  // and the basin file behind them. Entries are written by the root once the partials are reduced
+  class ResultCache {
+    public:
+    ResultCache() = default;
+    // the time window and the regions, with the fingerprint of the basin file they
+    // were made from (see RegionRaster::source), are part of the key of every obs space
+    ResultCache(const std::string & directory, const util::TimeWindow & timeWindow,
+                const eckit::LocalConfiguration & regions, const std::string & regionsSource)
+      : directory_(directory) {
+      std::ostringstream os;
+      os << "version " << kVersion << "\nwindow " << timeWindow.start().toString() << " "
+         << timeWindow.end().toString() << "\nregions " << regions << "\nregion sources "
+         << regionsSource << "\n";
+      shared_ = os.str();
+      std::filesystem::create_directories(directory_);
+    }
+
+    bool enabled() const { return !directory_.empty(); }
+
+    // text of the fingerprint of an obs space, empty when its input file is missing
+    std::string key(const eckit::LocalConfiguration & obsSpace, const std::string & obsFile) const {
+      std::error_code err;
+      const uintmax_t size = std::filesystem::file_size(obsFile, err);
+      if (err) return "";
+      const auto mtime = std::filesystem::last_write_time(obsFile, err);
+      if (err) return "";
+      std::ostringstream os;
+      os << shared_ << "file " << obsFile << " " << size << " "
+         << mtime.time_since_epoch().count() << "\nobs space " << obsSpace << "\n";
+      return os.str();
+    }
+
+    // the stored state of key, false when there is none
+    bool load(const std::string & key, std::vector<char> & state) const {
+      if (!enabled() || key.empty()) return false;
+      std::ifstream in(path(key), std::ios::binary);
+      if (!in) return false;
+      uint64_t keySize = 0;
+      in.read(reinterpret_cast<char *>(&keySize), sizeof(keySize));
+      std::string storedKey(in ? keySize : 0, '\0');
+      in.read(&storedKey[0], storedKey.size());
+      // a different key with the same hash is a miss
+      if (!in || storedKey != key) return false;
+      state.assign(std::istreambuf_iterator<char>(in), std::istreambuf_iterator<char>());
+      return true;
+    }
+
+    // written to a temporary file then renamed, so a run stopped while writing
+    // leaves no partial entry
+    void store(const std::string & key, const std::vector<char> & state) const {
+      if (!enabled() || key.empty()) return;
+      const std::string file = path(key);
+      const std::string tmpfile = file + ".tmp";
+      {
+        std::ofstream out(tmpfile, std::ios::binary | std::ios::trunc);
+        const uint64_t keySize = key.size();
+        out.write(reinterpret_cast<const char *>(&keySize), sizeof(keySize));
+        out.write(key.data(), key.size());
+        out.write(state.data(), state.size());
+        out.close();
+        // only a complete entry is renamed into place
+        if (!out) {
+          oops::Log::warning() << "ResultCache: cannot write " << tmpfile << std::endl;
+          std::error_code err;
+          std::filesystem::remove(tmpfile, err);
+          return;
+        }
+      }
+      std::filesystem::rename(tmpfile, file);
+    }
+
+    // flat copies of accumulators, in the order they are put and got back
+    template <typename T>
+    static void put(std::vector<char> & state, const std::vector<T> & values) {
+      static_assert(std::is_trivially_copyable<T>::value, "accumulators are copied as bytes");
+      const uint64_t n = values.size();
+      const char * bytes = reinterpret_cast<const char *>(&n);
+      state.insert(state.end(), bytes, bytes + sizeof(n));
+      bytes = reinterpret_cast<const char *>(values.data());
+      state.insert(state.end(), bytes, bytes + n * sizeof(T));
+    }
+    static void put(std::vector<char> & state, const std::vector<Distribution> & dists) {
+      for (const Distribution & dist : dists) dist.pack(state);
+    }
+    // values must already have the size they were stored with
+    template <typename T>
+    static void get(const char *& buf, const char * end, std::vector<T> & values) {
+      uint64_t n;
+      if (end - buf < static_cast<std::ptrdiff_t>(sizeof(n))) {
+        throw eckit::Exception("ResultCache: truncated entry");
+      }
+      std::memcpy(&n, buf, sizeof(n));
+      buf += sizeof(n);
+      if (n != values.size() || end - buf < static_cast<std::ptrdiff_t>(n * sizeof(T))) {
+        throw eckit::Exception("ResultCache: entry does not match the configuration");
+      }
+      std::memcpy(values.data(), buf, n * sizeof(T));
+      buf += n * sizeof(T);
+    }
+    // dists must be configured as when they were stored, every unpack is bounded by end
+    static void get(const char *& buf, const char * end, std::vector<Distribution> & dists) {
+      try {
+        for (Distribution & dist : dists) dist.unpack(buf, end);
+      } catch (const eckit::Exception &) {
+        throw eckit::Exception("ResultCache: truncated entry");
+      }
+    }
+
+    private:
+    // entries are named by the FNV-1a hash of their key
+    std::string path(const std::string & key) const {
+      uint64_t hash = 14695981039346656037ull;
+      for (const char c : key) {
+        hash ^= static_cast<unsigned char>(c);
+        hash *= 1099511628211ull;
+      }
+      char name[17];
+      std::snprintf(name, sizeof(name), "%016llx", static_cast<unsigned long long>(hash));
+      return (std::filesystem::path(directory_) / (std::string(name) + ".stats")).string();
+    }
+
+    // changed with the layout of the accumulators, invalidates older entries
+    static constexpr int kVersion = 1;
+
+    std::string directory_;
+    std::string shared_;
+  };
+}  // namespace dautils
@@ -1,26 +1,85 @@
 #pragma once
 
+#include <mpi.h>
 #include <netcdf>
+// NC_HAS_PARALLEL4, whether this netCDF can write with MPI-IO
+#include <netcdf_meta.h>
+#if NC_HAS_PARALLEL4
+#include <netcdf_par.h>
+#endif
+
+#include <algorithm>
+#include <fstream>
+#include <map>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "eckit/exception/Exceptions.h"
+#include "eckit/mpi/Comm.h"
 
 #include "oops/util/DateTime.h"
 #include "oops/util/Logger.h"
+#include "oops/util/missingValues.h"
 #include "oops/util/TimeWindow.h"
 
+#include "./gridbins.h"
+#include "./readplan.h"
+#include "./statregistry.h"
+
 namespace dautils {
+  // -----------------------------------------------------------------------------
+  // the contiguous block of domains [first, last) written by rank of nranks
+  // in parallel output
+  inline std::pair<size_t, size_t> domainBlock(const size_t ndomains, const size_t nranks,
+                                               const size_t rank) {
+    return {ndomains * rank / nranks, ndomains * (rank + 1) / nranks};
+  }
+
+  // -----------------------------------------------------------------------------
   class StatFile {
     public:
+    // with comm, parallel output: the file, already defined by one rank, is opened on
+    // every rank of comm with MPI-IO (append must be set), each rank writes the
+    // hyperslabs of its block of domains and the statistics without a Domain dimension
+    // are written by the rank of the Global domain. All ranks make the same calls,
+    // flush and close are collective
+    explicit StatFile(const eckit::mpi::Comm * comm = nullptr) : comm_(comm) {}
 
+    // the file stays open until flush/close so results are not written one at a time
+    // with append, an existing file is reopened and this cycle is added along analysisCycle
     int initializeNcfile(const std::string filename, const util::TimeWindow timeWindow,
                       std::vector<std::string> variables, std::vector<int> channels,
-                      std::vector<std::string> groups, std::vector<std::string> stats,
-                      std::vector<std::string> domainNames) {
-      netCDF::NcFile ncFile(filename, netCDF::NcFile::replace);
+                      std::vector<std::string> groups, const StatPlan & stats,
+                      std::vector<std::string> domainNames, const bool append = false) {
+      domainNames.push_back("Global");
+      ndomains_ = domainNames.size();
+      nchans_ = std::max<size_t>(1, channels.size());
+      hasChannels_ = !channels.empty();
+      appending_ = append && std::ifstream(filename).good();
+      // a file built cycle after cycle is chunked over many of them, a single cycle
+      // file over one so its chunks are no bigger than its data
+      cycleChunk_ = append ? kCycleChunk : 1;
+      const std::string validTime = timeWindow.midpoint().toString();
+      if (comm_ != nullptr) {
+        if (!appending_) {
+          throw eckit::UserError("StatFile: parallel output needs " + filename
+                                 + " to be defined first");
+        }
+        domains_ = domainBlock(ndomains_, comm_->size(), comm_->rank());
+      } else {
+        domains_ = {0, ndomains_};
+      }
+      if (appending_) {
+        return appendNcfile(filename, validTime, variables, channels, groups, stats, domainNames);
+      }
+      ncFile_.open(filename, netCDF::NcFile::replace);
+      root_ = ncFile_;
       oops::Log::info() << "Opening " << filename << " for writing..." << std::endl;
       // create an unlimited time dimension
-      netCDF::NcDim tDim = ncFile.addDim("analysisCycle");
+      netCDF::NcDim tDim = root_.addDim("analysisCycle");
       // create domain dimension
-      int ndomains = domainNames.size() + 1;
-      netCDF::NcDim dDim = ncFile.addDim("Domain", ndomains);
+      netCDF::NcDim dDim = root_.addDim("Domain", ndomains_);
       // vector of dimensions
       std::vector<netCDF::NcDim> dimVector;
       dimVector.push_back(tDim);
@@ -28,74 +87,507 @@ namespace dautils {
       // if channel is not empty, create a channel dimension
       netCDF::NcDim cDim;
       if (!channels.empty()) {
-        cDim = ncFile.addDim("Channel", channels.size());
+        cDim = root_.addDim("Channel", channels.size());
         dimVector.push_back(cDim);
+        // keep the channel numbers so appended cycles can be checked against them
+        netCDF::NcVar channelNumber = root_.addVar("channelNumber", netCDF::ncInt, cDim);
+        channelNumber.putVar(channels.data());
       }
       // create validTime variable
-      netCDF::NcVar time = ncFile.addVar("validTime", netCDF::ncString, tDim);
+      netCDF::NcVar time = root_.addVar("validTime", netCDF::ncString, tDim);
       // put the analysis time in the file
-      util::DateTime analysisTime = timeWindow.midpoint();
+      cycle_ = 0;
       std::vector<size_t> idxout;
-      idxout.push_back(0);
-      time.putVar(idxout, analysisTime.toString());
+      idxout.push_back(cycle_);
+      time.putVar(idxout, validTime);
 
       // create domain variable
-      netCDF::NcVar domain = ncFile.addVar("statisticDomain", netCDF::ncString, dDim);
-      domainNames.push_back("Global");
-      for (int idom = 0; idom < ndomains; idom++) {
+      netCDF::NcVar domain = root_.addVar("statisticDomain", netCDF::ncString, dDim);
+      for (int idom = 0; idom < ndomains_; idom++) {
         std::vector<size_t> idxdom;
         idxdom.push_back(idom);
         domain.putVar(idxdom, domainNames[idom]);
       }
 
+      // extra dimensions of the distribution statistics, with their coordinate
+      std::map<std::string, netCDF::NcDim> extraDims;
+      for (const StatEntry & stat : stats.entries()) {
+        if (stat.dimension.empty() || extraDims.count(stat.dimension) > 0) continue;
+        netCDF::NcDim eDim = root_.addDim(stat.dimension, stat.width());
+        netCDF::NcVar coordinate = root_.addVar(stat.coordinateName, netCDF::ncFloat, eDim);
+        coordinate.putVar(stat.coordinate.data());
+        extraDims[stat.dimension] = eDim;
+      }
+
+      // chunk along analysisCycle so a time series of one variable is read in a few chunks
+      std::vector<size_t> chunks = {cycleChunk_, ndomains_};
+      if (!channels.empty()) chunks.push_back(nchans_);
+
       // loop over group, then variables, then stats to create /group/var/stat in file
       for (int g = 0; g < groups.size(); g++) {
         // create group group
-        netCDF::NcGroup group = ncFile.addGroup(groups[g]);
+        netCDF::NcGroup group = root_.addGroup(groups[g]);
         // loop over variables
         for (int var = 0; var < variables.size(); var++) {
           // create variable group
           netCDF::NcGroup group2 = group.addGroup(variables[var]);
           // loop over statistics to write out
-          for (int s = 0; s < stats.size(); s++) {
+          for (const StatEntry & stat : stats.entries()) {
+            std::vector<netCDF::NcDim> statDims = dimVector;
+            std::vector<size_t> statChunks = chunks;
+            if (!stat.dimension.empty()) {
+              statDims.push_back(extraDims.at(stat.dimension));
+              statChunks.push_back(stat.width());
+            }
+            // cut the channels, then the extra dimension, domains and cycles
+            std::vector<size_t> order;
+            if (!channels.empty()) order.push_back(2);
+            if (!stat.dimension.empty()) order.push_back(statChunks.size() - 1);
+            order.insert(order.end(), {1, 0});
+            netCDF::NcVar varout = group2.addVar(stat.name,
+                                                 stat.integer ? netCDF::ncInt : netCDF::ncFloat,
+                                                 statDims);
+            varout.setChunking(netCDF::NcVar::nc_CHUNKED,
+                               boundChunks(statChunks, order, sizeof(float)));
+            addOutput(groups[g], variables[var], stat, varout);
+          }
+        }
+      }
+      oops::Log::info() << "Output file " << filename << " has been created." << std::endl;
+      return 0;
+    };
+
+    // Overloaded write methods, these only buffer the values of one domain
+    // (one per channel, times the extra dimension of distribution statistics),
+    // flush writes them out
+    int write(const std::string group, const std::string variable,
+              const std::string stat, const int idom, const std::vector<int> &intvals) {
+      OutputVar & out = outputs_.at(key(group, variable, stat));
+      std::copy(intvals.begin(), intvals.end(), out.intvals.begin() + idom * out.stride);
+      out.pending = true;
+      return 0;
+    };
+
+    int write(const std::string group, const std::string variable,
+              const std::string stat, const int idom, const std::vector<float> &floatvals) {
+      OutputVar & out = outputs_.at(key(group, variable, stat));
+      std::copy(floatvals.begin(), floatvals.end(), out.floatvals.begin() + idom * out.stride);
+      out.pending = true;
+      return 0;
+    };
+
+    // add (or with append, check) the gridded statistics of every group/variable,
+    // /group/variable/gridded/stat over the bins of grid and the channels.
+    // only the statistics computed from moments are gridded
+    int initializeGrid(const BinGrid & grid, const std::vector<std::string> & variables,
+                       const std::vector<std::string> & groups, const StatPlan & stats) {
+      return initializeBins("gridded", grid.axes(), false, variables, groups, stats);
+    };
+
+    // same for the statistics of every domain per sub-window time bin,
+    // /group/variable/timeBinned/stat over the domains, the time bins and the channels
+    int initializeTimeBins(const TimeBins & bins, const std::vector<std::string> & variables,
+                           const std::vector<std::string> & groups, const StatPlan & stats) {
+      return initializeBins("timeBinned", {bins.axis()}, true, variables, groups, stats);
+    };
+
+    // add (or with append, check) the paired statistics of every pair and variable,
+    // /pair name/variable/stat over the domains and channels like the other statistics
+    int initializePairs(const std::vector<GroupPair> & pairs,
+                        const std::vector<std::string> & variables, const PairStatPlan & stats) {
+      std::vector<netCDF::NcDim> dimVector = {root_.getDim("analysisCycle"),
+                                              root_.getDim("Domain")};
+      std::vector<size_t> counts = {ndomains_};
+      if (hasChannels_) {
+        dimVector.push_back(root_.getDim("Channel"));
+        counts.push_back(nchans_);
+      }
+      std::vector<size_t> chunks = {cycleChunk_};
+      chunks.insert(chunks.end(), counts.begin(), counts.end());
+      // cut the channels, then the domains and cycles
+      std::vector<size_t> order;
+      if (hasChannels_) order.push_back(2);
+      order.insert(order.end(), {1, 0});
+      chunks = boundChunks(chunks, order, sizeof(float));
+      for (const GroupPair & pair : pairs) {
+        netCDF::NcGroup group = root_.getGroup(pair.name);
+        if (group.isNull() && !appending_) group = root_.addGroup(pair.name);
+        for (const std::string & variable : variables) {
+          netCDF::NcGroup group2 = group.isNull() ? group : group.getGroup(variable);
+          if (group2.isNull() && !appending_) group2 = group.addGroup(variable);
+          for (const PairStatEntry & stat : stats.entries()) {
             netCDF::NcVar varout;
-            if (stats[s] == "count") {
-              varout = group2.addVar(stats[s], netCDF::ncInt, dimVector);
+            if (appending_) {
+              varout = group2.isNull() ? netCDF::NcVar() : group2.getVar(stat.name);
+              if (varout.isNull()) {
+                throw eckit::Exception("StatFile: output file has no " + pair.name + "/"
+                                       + variable + "/" + stat.name);
+              }
             } else {
-              varout = group2.addVar(stats[s], netCDF::ncFloat, dimVector);
+              varout = group2.addVar(stat.name, stat.integer ? netCDF::ncInt : netCDF::ncFloat,
+                                     dimVector);
+              varout.setChunking(netCDF::NcVar::nc_CHUNKED, chunks);
             }
+            addOutput(key(pair.name, variable, stat.name), stat.integer, counts, true, varout);
           }
         }
       }
-      oops::Log::info() << "Output file " << filename << " has been created." << std::endl;
       return 0;
     };
 
-    // Overloaded write methods
-    int write(const std::string filename, const std::string group, const std::string variable,
-              const std::string stat, const int idom, const std::vector<int> intvals) {
-      netCDF::NcFile ncFile(filename, netCDF::NcFile::write);
-      netCDF::NcGroup outgroup1 = ncFile.getGroup(group);
-      netCDF::NcGroup outgroup2 = outgroup1.getGroup(variable);
-      netCDF::NcVar outvar = outgroup2.getVar(stat);
-      std::vector<size_t> idxout;
-      idxout.push_back(0);
-      idxout.push_back(idom);
-      outvar.putVar(idxout, intvals[0]);
+    // binned values of one group/variable/stat, in the order of the dimensions
+    int writeBinned(const std::string subgroup, const std::string group,
+                    const std::string variable, const std::string stat,
+                    const std::vector<int> &intvals) {
+      return write(group, variable, subgroup + "/" + stat, 0, intvals);
+    };
+
+    int writeBinned(const std::string subgroup, const std::string group,
+                    const std::string variable, const std::string stat,
+                    const std::vector<float> &floatvals) {
+      return write(group, variable, subgroup + "/" + stat, 0, floatvals);
+    };
+
+    // write each buffered group/variable/stat as one hyperslab over all domains and channels
+    int flush() {
+      const bool ownsGlobal = domains_.first < ndomains_ && domains_.second == ndomains_;
+      for (auto & item : outputs_) {
+        OutputVar & out = item.second;
+        if (!out.pending) continue;
+        std::vector<size_t> idxout(out.var.getDimCount(), 0);
+        idxout[0] = cycle_;
+        std::vector<size_t> countout = {1};
+        countout.insert(countout.end(), out.counts.begin(), out.counts.end());
+        // only the domains of this rank, or nothing, in parallel output
+        size_t offset = 0;
+        if (out.perDomain) {
+          idxout[1] = domains_.first;
+          countout[1] = domains_.second - domains_.first;
+          offset = domains_.first * out.stride;
+        } else if (!ownsGlobal) {
+          countout[0] = 0;
+        }
+        if (out.intvals.empty()) {
+          out.var.putVar(idxout, countout, out.floatvals.data() + offset);
+        } else {
+          out.var.putVar(idxout, countout, out.intvals.data() + offset);
+        }
+        out.pending = false;
+      }
       return 0;
     };
 
-    int write(const std::string filename, const std::string group, const std::string variable,
-              const std::string stat, const int idom, const std::vector<float> floatvals) {
-      netCDF::NcFile ncFile(filename, netCDF::NcFile::write);
-      netCDF::NcGroup outgroup1 = ncFile.getGroup(group);
-      netCDF::NcGroup outgroup2 = outgroup1.getGroup(variable);
-      netCDF::NcVar outvar = outgroup2.getVar(stat);
-      std::vector<size_t> idxout;
-      idxout.push_back(0);
-      idxout.push_back(idom);
-      outvar.putVar(idxout, floatvals[0]);
+    // global attribute of the file, replaced when the file is appended to
+    // in parallel output the value of the first rank is used by all
+    void putAttribute(const std::string & name, double value) {
+      if (comm_ != nullptr) {
+        MPI_Bcast(&value, 1, MPI_DOUBLE, 0, MPI_Comm_f2c(comm_->communicator()));
+      }
+      root_.putAtt(name, netCDF::ncDouble, value);
+    }
+    void putAttribute(const std::string & name, std::string value) {
+      if (comm_ != nullptr) {
+        const MPI_Comm mpiComm = MPI_Comm_f2c(comm_->communicator());
+        int size = value.size();
+        MPI_Bcast(&size, 1, MPI_INT, 0, mpiComm);
+        value.resize(size);
+        MPI_Bcast(&value[0], size, MPI_CHAR, 0, mpiComm);
+      }
+      root_.putAtt(name, value);
+    }
+
+    // whether the statistics of domain idom are written by this rank
+    bool ownsDomain(const size_t idom) const {
+      return idom >= domains_.first && idom < domains_.second;
+    }
+
+    int close() {
+      flush();
+      if (comm_ != nullptr) {
+        checkNc(nc_close(root_.getId()), "closing the output file");
+      } else {
+        ncFile_.close();
+      }
       return 0;
     };
+
+    private:
+    // binned statistics under /group/variable/subgroup, over the domains when
+    // perDomain, then the axes, then the channels
+    int initializeBins(const std::string & subgroup, const std::vector<BinAxis> & axes,
+                       const bool perDomain, const std::vector<std::string> & variables,
+                       const std::vector<std::string> & groups, const StatPlan & stats) {
+      std::vector<netCDF::NcDim> dimVector = {root_.getDim("analysisCycle")};
+      std::vector<size_t> counts;
+      if (perDomain) {
+        dimVector.push_back(root_.getDim("Domain"));
+        counts.push_back(ndomains_);
+      }
+      for (const BinAxis & axis : axes) {
+        netCDF::NcDim dim = root_.getDim(axis.dimension);
+        const std::vector<float> centers = axis.centers();
+        if (appending_) {
+          netCDF::NcVar coordinate = root_.getVar(axis.coordinateName);
+          std::vector<float> fileCenters(centers.size());
+          if (!dim.isNull() && dim.getSize() == centers.size() && !coordinate.isNull()) {
+            coordinate.getVar(fileCenters.data());
+          }
+          if (dim.isNull() || fileCenters != centers) {
+            throw eckit::Exception("StatFile: output file has a different " + axis.dimension
+                                   + " dimension");
+          }
+        } else {
+          dim = root_.addDim(axis.dimension, axis.nbins);
+          root_.addVar(axis.coordinateName, netCDF::ncFloat, dim).putVar(centers.data());
+        }
+        dimVector.push_back(dim);
+        counts.push_back(axis.nbins);
+      }
+      if (hasChannels_) {
+        dimVector.push_back(root_.getDim("Channel"));
+        counts.push_back(nchans_);
+      }
+      std::vector<size_t> chunks = {1};
+      chunks.insert(chunks.end(), counts.begin(), counts.end());
+      // a map of one channel and level in as few chunks as the budget allows: cut the
+      // channels first, then the levels (axes past the first two), the domains and last
+      // the latitudes/longitudes
+      const size_t firstAxis = perDomain ? 2 : 1;
+      std::vector<size_t> order;
+      if (hasChannels_) order.push_back(chunks.size() - 1);
+      for (size_t a = axes.size(); a-- > 2;) order.push_back(firstAxis + a);
+      if (perDomain) order.push_back(1);
+      for (size_t a = std::min<size_t>(2, axes.size()); a-- > 0;) order.push_back(firstAxis + a);
+      chunks = boundChunks(chunks, order, sizeof(float));
+
+      for (const std::string & groupName : groups) {
+        for (const std::string & variable : variables) {
+          netCDF::NcGroup group = root_.getGroup(groupName).getGroup(variable);
+          netCDF::NcGroup binned = group.getGroup(subgroup);
+          if (binned.isNull()) {
+            if (appending_) {
+              throw eckit::Exception("StatFile: output file has no " + subgroup
+                                     + " statistics of " + groupName + "/" + variable);
+            }
+            binned = group.addGroup(subgroup);
+          }
+          for (const StatEntry & stat : stats.entries()) {
+            if ((stat.needs & kNeedDistribution) != 0) continue;
+            netCDF::NcVar varout = binned.getVar(stat.name);
+            if (appending_ && varout.isNull()) {
+              throw eckit::Exception("StatFile: output file has no " + groupName + "/"
+                                     + variable + "/" + subgroup + "/" + stat.name);
+            }
+            if (!appending_) {
+              varout = binned.addVar(stat.name, stat.integer ? netCDF::ncInt : netCDF::ncFloat,
+                                     dimVector);
+              varout.setChunking(netCDF::NcVar::nc_CHUNKED, chunks);
+            }
+            addOutput(key(groupName, variable, subgroup + "/" + stat.name), stat.integer, counts,
+                      perDomain, varout);
+          }
+        }
+      }
+      return 0;
+    };
+
+    // reopen an existing stat file, check it holds the same layout as this run
+    // and point the output at the next analysisCycle record
+    int appendNcfile(const std::string & filename, const std::string & validTime,
+                     const std::vector<std::string> & variables, const std::vector<int> & channels,
+                     const std::vector<std::string> & groups, const StatPlan & stats,
+                     const std::vector<std::string> & domainNames) {
+      openForWriting(filename);
+      oops::Log::info() << "Opening " << filename << " for appending..." << std::endl;
+
+      // domains must match in number and name
+      netCDF::NcDim dDim = root_.getDim("Domain");
+      if (dDim.isNull() || dDim.getSize() != ndomains_) {
+        throw eckit::Exception("StatFile: " + filename + " has a different number of domains");
+      }
+      const std::vector<std::string> fileDomains = readStrings(root_.getVar("statisticDomain"),
+                                                               ndomains_);
+      if (fileDomains != domainNames) {
+        throw eckit::Exception("StatFile: " + filename + " has different domains");
+      }
+
+      // channels must match in number and, when stored, in value
+      netCDF::NcDim cDim = root_.getDim("Channel");
+      const size_t fileChans = cDim.isNull() ? 0 : cDim.getSize();
+      if (fileChans != channels.size()) {
+        throw eckit::Exception("StatFile: " + filename + " has a different number of channels");
+      }
+      netCDF::NcVar channelNumber = root_.getVar("channelNumber");
+      if (!channels.empty() && !channelNumber.isNull()) {
+        std::vector<int> fileChannels(fileChans);
+        channelNumber.getVar(fileChannels.data());
+        if (fileChannels != channels) {
+          throw eckit::Exception("StatFile: " + filename + " has different channels");
+        }
+      }
+
+      // extra dimensions must hold the same quantile levels and histogram bins
+      for (const StatEntry & stat : stats.entries()) {
+        if (stat.dimension.empty()) continue;
+        netCDF::NcDim eDim = root_.getDim(stat.dimension);
+        netCDF::NcVar coordinate = root_.getVar(stat.coordinateName);
+        std::vector<float> fileCoordinate(stat.width());
+        if (!eDim.isNull() && eDim.getSize() == stat.width() && !coordinate.isNull()) {
+          coordinate.getVar(fileCoordinate.data());
+        }
+        if (eDim.isNull() || fileCoordinate != stat.coordinate) {
+          throw eckit::Exception("StatFile: " + filename + " has a different " + stat.dimension
+                                 + " dimension");
+        }
+      }
+
+      // every group/variable/stat of this run must already be there
+      for (int g = 0; g < groups.size(); g++) {
+        netCDF::NcGroup group = root_.getGroup(groups[g]);
+        for (int var = 0; var < variables.size(); var++) {
+          netCDF::NcGroup group2 = group.isNull() ? group : group.getGroup(variables[var]);
+          for (const StatEntry & stat : stats.entries()) {
+            netCDF::NcVar varout = group2.isNull() ? netCDF::NcVar() : group2.getVar(stat.name);
+            if (varout.isNull()) {
+              throw eckit::Exception("StatFile: " + filename + " has no " + groups[g] + "/"
+                                     + variables[var] + "/" + stat.name);
+            }
+            addOutput(groups[g], variables[var], stat, varout);
+          }
+        }
+      }
+
+      // write at the next record, or over the record of a rerun cycle
+      netCDF::NcVar time = root_.getVar("validTime");
+      const size_t ncycles = root_.getDim("analysisCycle").getSize();
+      const std::vector<std::string> fileTimes = readStrings(time, ncycles);
+      cycle_ = std::find(fileTimes.begin(), fileTimes.end(), validTime) - fileTimes.begin();
+      // in parallel output it was written when the file was defined
+      if (comm_ == nullptr) {
+        std::vector<size_t> idxout;
+        idxout.push_back(cycle_);
+        time.putVar(idxout, validTime);
+      }
+      oops::Log::info() << "Writing " << validTime << " as analysisCycle " << cycle_
+                        << " of " << filename << std::endl;
+      return 0;
+    };
+
+    // a statistic over the domains, the channels and its extra dimension
+    void addOutput(const std::string & group, const std::string & variable,
+                   const StatEntry & stat, const netCDF::NcVar & var) {
+      std::vector<size_t> counts = {ndomains_};
+      if (hasChannels_) counts.push_back(nchans_);
+      if (!stat.dimension.empty()) counts.push_back(stat.width());
+      addOutput(key(group, variable, stat.name), stat.integer, counts, true, var);
+    }
+    // counts gives the size of each dimension of var after analysisCycle, the first
+    // one is Domain when perDomain
+    void addOutput(const std::string & name, const bool integer,
+                   const std::vector<size_t> & counts, const bool perDomain,
+                   const netCDF::NcVar & var) {
+      OutputVar & out = outputs_[name];
+      out.var = var;
+      out.counts = counts;
+      out.perDomain = perDomain;
+      // every output is written in parallel, all ranks take part in each write
+      if (comm_ != nullptr) {
+        out.pending = true;
+#if NC_HAS_PARALLEL4
+        checkNc(nc_var_par_access(var.getParentGroup().getId(), var.getId(), NC_COLLECTIVE),
+                "setting collective access to " + name);
+#endif
+      }
+      size_t size = 1;
+      for (const size_t count : counts) size *= count;
+      out.stride = size / counts[0];
+      if (integer) {
+        out.intvals.assign(size, util::missingValue<int>());
+      } else {
+        out.floatvals.assign(size, util::missingValue<float>());
+      }
+    }
+
+    // the existing file, opened on every rank of comm_ in parallel output
+    void openForWriting(const std::string & filename) {
+      if (comm_ == nullptr) {
+        ncFile_.open(filename, netCDF::NcFile::write);
+        root_ = ncFile_;
+        return;
+      }
+#if NC_HAS_PARALLEL4
+      int ncid;
+      checkNc(nc_open_par(filename.c_str(), NC_WRITE, MPI_Comm_f2c(comm_->communicator()),
+                          MPI_INFO_NULL, &ncid), "opening " + filename + " in parallel");
+      root_ = netCDF::NcGroup(ncid);
+#else
+      throw eckit::UserError("StatFile: parallel output needs netCDF built with parallel I/O");
+#endif
+    }
+    static void checkNc(const int status, const std::string & what) {
+      if (status != NC_NOERR) {
+        throw eckit::Exception("StatFile: " + what + " failed: " + nc_strerror(status));
+      }
+    }
+
+    static std::vector<std::string> readStrings(const netCDF::NcVar & var, const size_t n) {
+      std::vector<std::string> values;
+      if (n == 0) return values;
+      std::vector<char *> buf(n, nullptr);
+      var.getVar(buf.data());
+      for (char * str : buf) values.push_back(str ? str : "");
+      nc_free_string(n, buf.data());
+      return values;
+    }
+
+    struct OutputVar {
+      netCDF::NcVar var;
+      std::vector<int> intvals;
+      std::vector<float> floatvals;
+      std::vector<size_t> counts;   // dimensions after analysisCycle
+      size_t stride = 1;            // values per domain
+      bool perDomain = true;        // first dimension after analysisCycle is Domain
+      bool pending = false;
+    };
+    static std::string key(const std::string & group, const std::string & variable,
+                           const std::string & stat) {
+      return group + "/" + variable + "/" + stat;
+    }
+
+    // chunks cut down to at most kChunkBytes: the dimensions in order are reduced
+    // one after the other, each to what the budget leaves once the others are whole
+    static std::vector<size_t> boundChunks(std::vector<size_t> chunks,
+                                           const std::vector<size_t> & order,
+                                           const size_t valueBytes) {
+      const size_t budget = std::max<size_t>(1, kChunkBytes / valueBytes);
+      size_t values = 1;
+      for (const size_t n : chunks) values *= n;
+      for (const size_t d : order) {
+        if (values <= budget) break;
+        const size_t others = values / chunks[d];
+        chunks[d] = std::max<size_t>(1, budget / others);
+        values = others * chunks[d];
+      }
+      return chunks;
+    }
+
+    // number of analysis cycles in one chunk of the output variables of a file
+    // created to be appended to
+    static constexpr size_t kCycleChunk = 64;
+    // largest chunk of an output variable, well below the 4 GiB HDF5 limit and a
+    // sensible unit for reading one map or time series
+    static constexpr size_t kChunkBytes = 4 * 1024 * 1024;
+
+    netCDF::NcFile ncFile_;
+    netCDF::NcGroup root_;         // ncFile_, or the file opened in parallel
+    const eckit::mpi::Comm * comm_ = nullptr;
+    std::pair<size_t, size_t> domains_;   // block of domains written by this rank
+    std::map<std::string, OutputVar> outputs_;
+    size_t cycle_ = 0;
+    size_t cycleChunk_ = 1;
+    size_t ndomains_ = 0;
+    size_t nchans_ = 1;
+    bool hasChannels_ = false;
+    bool appending_ = false;
   };
 }  // namespace dautils
@@ -0,0 +1,379 @@
+#pragma once
+
+#include <cstdint>
+#include <limits>
+#include <string>
+#include <tuple>
+#include <type_traits>
+#include <vector>
+
+#include "eckit/config/LocalConfiguration.h"
+#include "eckit/exception/Exceptions.h"
+
+#include "oops/util/Logger.h"
+
+#include "./calcstats.h"
+
+namespace dautils {
+  // -----------------------------------------------------------------------------
+  // settings of the distribution statistics of an obs space: the "quantiles" levels
+  // (default 5, 25, 50, 75 and 95%), the "quantile sketch size" and the "histogram"
+  // range and number of bins
+  struct DistributionConfig {
+    std::vector<float> levels = {0.05f, 0.25f, 0.5f, 0.75f, 0.95f};
+    size_t sketchSize = 200;
+    float histogramMin = 0.0f;
+    float histogramMax = 0.0f;
+    size_t histogramBins = 0;
+
+    DistributionConfig() = default;
+    explicit DistributionConfig(const eckit::Configuration & conf) {
+      if (conf.has("quantiles")) {
+        conf.get("quantiles", levels);
+      }
+      if (conf.has("quantile sketch size")) {
+        conf.get("quantile sketch size", sketchSize);
+      }
+      if (conf.has("histogram")) {
+        const eckit::LocalConfiguration histConf(conf, "histogram");
+        histConf.get("min", histogramMin);
+        histConf.get("max", histogramMax);
+        histConf.get("bins", histogramBins);
+        if (histogramBins == 0 || !(histogramMax > histogramMin)) {
+          throw eckit::BadValue("histogram needs min < max and at least one bin");
+        }
+      }
+    }
+
+    // lower edge of each bin, the first and last bins are open ended
+    std::vector<float> binEdges() const {
+      std::vector<float> edges;
+      for (size_t b = 0; b < histogramBins; b++) {
+        edges.push_back(histogramMin + static_cast<float>(b) * (histogramMax - histogramMin)
+                                       / static_cast<float>(histogramBins));
+      }
+      return edges;
+    }
+  };
+
+  // -----------------------------------------------------------------------------
+  // a count as written to the int output variables, clamped (with a warning) past the
+  // largest int rather than wrapped
+  inline int outputCount(const int64_t count) {
+    if (count <= std::numeric_limits<int>::max()) return static_cast<int>(count);
+    static bool warned = false;
+    if (!warned) {
+      oops::Log::warning() << "a count of " << count << " does not fit an int output, "
+                           << "counts are clamped to " << std::numeric_limits<int>::max()
+                           << std::endl;
+      warned = true;
+    }
+    return std::numeric_limits<int>::max();
+  }
+
+  // -----------------------------------------------------------------------------
+  // every statistic is a type giving its name, its output type, the moments it
+  // needs from the accumulation kernel and how it is computed from them.
+  // distribution statistics also give the extra dimension of their output.
+  // to add one, write the type and add it to StatRegistry below
+  struct CountStat {
+    static constexpr const char * name = "count";
+    using OutputType = int;
+    static constexpr unsigned needs = kNeedCount;
+    static int finalize(const StatAccumulator & acc, const float) {
+      return outputCount(acc.count);
+    }
+  };
+  struct MeanStat {
+    static constexpr const char * name = "mean";
+    using OutputType = float;
+    static constexpr unsigned needs = kNeedSum;
+    static float finalize(const StatAccumulator & acc, const float) {
+      return static_cast<float>(acc.mean());
+    }
+  };
+  struct RMSStat {
+    static constexpr const char * name = "RMS";
+    using OutputType = float;
+    static constexpr unsigned needs = kNeedSumSq;
+    static float finalize(const StatAccumulator & acc, const float) {
+      return static_cast<float>(acc.rms());
+    }
+  };
+  struct VarianceStat {
+    static constexpr const char * name = "variance";
+    using OutputType = float;
+    static constexpr unsigned needs = kNeedSum | kNeedSumSq;
+    static float finalize(const StatAccumulator & acc, const float) {
+      return static_cast<float>(acc.variance());
+    }
+  };
+  struct StddevStat {
+    static constexpr const char * name = "stddev";
+    using OutputType = float;
+    static constexpr unsigned needs = kNeedSum | kNeedSumSq;
+    static float finalize(const StatAccumulator & acc, const float) {
+      return static_cast<float>(acc.stddev());
+    }
+  };
+  struct MinStat {
+    static constexpr const char * name = "min";
+    using OutputType = float;
+    static constexpr unsigned needs = kNeedMinMax;
+    static float finalize(const StatAccumulator & acc, const float fillVal) {
+      return acc.count > 0 ? acc.min : fillVal;
+    }
+  };
+  struct MaxStat {
+    static constexpr const char * name = "max";
+    using OutputType = float;
+    static constexpr unsigned needs = kNeedMinMax;
+    static float finalize(const StatAccumulator & acc, const float fillVal) {
+      return acc.count > 0 ? acc.max : fillVal;
+    }
+  };
+  struct QuantilesStat {
+    static constexpr const char * name = "quantiles";
+    using OutputType = float;
+    static constexpr unsigned needs = kNeedQuantiles;
+    static constexpr const char * dimension = "Quantile";
+    static constexpr const char * coordinateName = "quantileLevel";
+    static std::vector<float> coordinate(const DistributionConfig & conf) { return conf.levels; }
+    static void finalize(const Distribution & dist, const DistributionConfig & conf,
+                         const float fillVal, std::vector<float> & out) {
+      const std::vector<float> values = dist.sketch.quantiles(conf.levels, fillVal);
+      out.insert(out.end(), values.begin(), values.end());
+    }
+  };
+  struct HistogramStat {
+    static constexpr const char * name = "histogram";
+    using OutputType = int;
+    static constexpr unsigned needs = kNeedHistogram;
+    static constexpr const char * dimension = "HistogramBin";
+    static constexpr const char * coordinateName = "histogramBinLowerEdge";
+    static std::vector<float> coordinate(const DistributionConfig & conf) {
+      return conf.binEdges();
+    }
+    static void finalize(const Distribution & dist, const DistributionConfig &,
+                         const float, std::vector<int> & out) {
+      for (const int64_t count : dist.histogram.counts()) out.push_back(outputCount(count));
+    }
+  };
+
+  using StatRegistry = std::tuple<CountStat, MeanStat, RMSStat, VarianceStat, StddevStat,
+                                  MinStat, MaxStat, QuantilesStat, HistogramStat>;
+
+  // -----------------------------------------------------------------------------
+  // one resolved entry of "statistics to compute"
+  struct StatEntry {
+    std::string name;
+    bool integer;   // written as int rather than float
+    unsigned needs;
+    // extra output dimension of distribution statistics, empty for one value per channel
+    std::string dimension;
+    std::string coordinateName;
+    std::vector<float> coordinate;
+    // values of the statistic for each accumulator or distribution (channel),
+    // into intvals or floatvals
+    void (*finalize)(const std::vector<StatAccumulator> &, const std::vector<Distribution> &,
+                     const DistributionConfig &, float,
+                     std::vector<int> &, std::vector<float> &);
+
+    size_t width() const { return dimension.empty() ? 1 : coordinate.size(); }
+  };
+
+  namespace detail {
+    template <typename Stat>
+    void finalizeStat(const std::vector<StatAccumulator> & accs,
+                      const std::vector<Distribution> & dists, const DistributionConfig & conf,
+                      const float fillVal,
+                      std::vector<int> & intvals, std::vector<float> & floatvals) {
+      auto & out = [&]() -> std::vector<typename Stat::OutputType> & {
+        if constexpr (std::is_same_v<typename Stat::OutputType, int>) {
+          return intvals;
+        } else {
+          return floatvals;
+        }
+      }();
+      out.clear();
+      if constexpr ((Stat::needs & kNeedDistribution) != 0) {
+        for (const Distribution & dist : dists) Stat::finalize(dist, conf, fillVal, out);
+      } else {
+        for (const StatAccumulator & acc : accs) out.push_back(Stat::finalize(acc, fillVal));
+      }
+    }
+
+    template <size_t I = 0>
+    bool resolveStat(const std::string & name, const DistributionConfig & conf,
+                     StatEntry & entry) {
+      if constexpr (I == std::tuple_size_v<StatRegistry>) {
+        return false;
+      } else {
+        using Stat = std::tuple_element_t<I, StatRegistry>;
+        if (name == Stat::name) {
+          entry = {name, std::is_same_v<typename Stat::OutputType, int>, Stat::needs, "", "", {},
+                   &finalizeStat<Stat>};
+          if constexpr ((Stat::needs & kNeedDistribution) != 0) {
+            entry.dimension = Stat::dimension;
+            entry.coordinateName = Stat::coordinateName;
+            entry.coordinate = Stat::coordinate(conf);
+          }
+          return true;
+        }
+        return resolveStat<I + 1>(name, conf, entry);
+      }
+    }
+  }  // namespace detail
+
+  // -----------------------------------------------------------------------------
+  // the "statistics to compute" list resolved once per obs space: the statistics
+  // to finalize and write, and the moments the kernels have to accumulate for them
+  class StatPlan {
+    public:
+    explicit StatPlan(const std::vector<std::string> & names,
+                      const DistributionConfig & distConf = DistributionConfig())
+      : distConf_(distConf) {
+      for (const std::string & name : names) {
+        StatEntry entry;
+        if (detail::resolveStat(name, distConf_, entry)) {
+          needs_ |= entry.needs;
+          entries_.push_back(entry);
+        } else {
+          oops::Log::info() << name << " not supported. Skipping." << std::endl;
+        }
+      }
+      if ((needs_ & kNeedHistogram) != 0 && distConf_.histogramBins == 0) {
+        throw eckit::BadValue("statistic histogram needs a histogram section");
+      }
+    }
+
+    const std::vector<StatEntry> & entries() const { return entries_; }
+    unsigned needs() const { return needs_; }
+    const DistributionConfig & distributionConfig() const { return distConf_; }
+
+    // an empty distribution with only the summaries the statistics use
+    Distribution distribution() const {
+      Distribution dist;
+      if ((needs_ & kNeedQuantiles) != 0) dist.sketch = QuantileSketch(distConf_.sketchSize);
+      if ((needs_ & kNeedHistogram) != 0) {
+        dist.histogram = Histogram(distConf_.histogramMin, distConf_.histogramMax,
+                                   distConf_.histogramBins);
+      }
+      return dist;
+    }
+
+    private:
+    DistributionConfig distConf_;
+    std::vector<StatEntry> entries_;
+    unsigned needs_ = kNeedCount;
+  };
+
+  // -----------------------------------------------------------------------------
+  // statistics of "paired statistics", comparing two groups x and y of a variable,
+  // written under a group combining both. Added to PairStatRegistry like the above
+  struct PairCountStat {
+    static constexpr const char * name = "count";
+    using OutputType = int;
+    static int finalize(const PairAccumulator & acc) { return outputCount(acc.count); }
+  };
+  struct CovarianceStat {
+    static constexpr const char * name = "covariance";
+    using OutputType = float;
+    static float finalize(const PairAccumulator & acc) {
+      return static_cast<float>(acc.covariance());
+    }
+  };
+  struct CorrelationStat {
+    static constexpr const char * name = "correlation";
+    using OutputType = float;
+    static float finalize(const PairAccumulator & acc) {
+      return static_cast<float>(acc.correlation());
+    }
+  };
+  struct CrossProductStat {
+    static constexpr const char * name = "crossProduct";
+    using OutputType = float;
+    static float finalize(const PairAccumulator & acc) {
+      return static_cast<float>(acc.crossProduct());
+    }
+  };
+  struct MeanDifferenceStat {
+    static constexpr const char * name = "meanDifference";
+    using OutputType = float;
+    static float finalize(const PairAccumulator & acc) {
+      return static_cast<float>(acc.meanDifference());
+    }
+  };
+  struct RMSRatioStat {
+    static constexpr const char * name = "RMSRatio";
+    using OutputType = float;
+    static float finalize(const PairAccumulator & acc) {
+      return static_cast<float>(acc.rmsRatio());
+    }
+  };
+
+  using PairStatRegistry = std::tuple<PairCountStat, CovarianceStat, CorrelationStat,
+                                      CrossProductStat, MeanDifferenceStat, RMSRatioStat>;
+
+  // one resolved entry of the paired "statistics to compute"
+  struct PairStatEntry {
+    std::string name;
+    bool integer;
+    void (*finalize)(const std::vector<PairAccumulator> &, std::vector<int> &,
+                     std::vector<float> &);
+  };
+
+  namespace detail {
+    template <typename Stat>
+    void finalizePairStat(const std::vector<PairAccumulator> & accs,
+                          std::vector<int> & intvals, std::vector<float> & floatvals) {
+      auto & out = [&]() -> std::vector<typename Stat::OutputType> & {
+        if constexpr (std::is_same_v<typename Stat::OutputType, int>) {
+          return intvals;
+        } else {
+          return floatvals;
+        }
+      }();
+      out.clear();
+      for (const PairAccumulator & acc : accs) out.push_back(Stat::finalize(acc));
+    }
+
+    template <size_t I = 0>
+    bool resolvePairStat(const std::string & name, PairStatEntry & entry) {
+      if constexpr (I == std::tuple_size_v<PairStatRegistry>) {
+        return false;
+      } else {
+        using Stat = std::tuple_element_t<I, PairStatRegistry>;
+        if (name == Stat::name) {
+          entry = {name, std::is_same_v<typename Stat::OutputType, int>,
+                   &finalizePairStat<Stat>};
+          return true;
+        }
+        return resolvePairStat<I + 1>(name, entry);
+      }
+    }
+  }  // namespace detail
+
+  // -----------------------------------------------------------------------------
+  // the paired statistics resolved once per obs space
+  class PairStatPlan {
+    public:
+    PairStatPlan() = default;
+    explicit PairStatPlan(const std::vector<std::string> & names) {
+      for (const std::string & name : names) {
+        PairStatEntry entry;
+        if (detail::resolvePairStat(name, entry)) {
+          entries_.push_back(entry);
+        } else {
+          oops::Log::info() << name << " not supported for paired statistics. Skipping."
+                            << std::endl;
+        }
+      }
+    }
+
+    const std::vector<PairStatEntry> & entries() const { return entries_; }
+
+    private:
+    std::vector<PairStatEntry> entries_;
+  };
+}  // namespace dautils
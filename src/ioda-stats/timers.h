@@ -0,0 +1,151 @@
+#pragma once
+
+#include <mpi.h>
+#include <sys/resource.h>
+
+#include <algorithm>
+#include <chrono>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "eckit/exception/Exceptions.h"
+#include "eckit/mpi/Comm.h"
+
+namespace dautils {
+  // -----------------------------------------------------------------------------
+  // wall time, number of calls and bytes of each phase of one obs space on this
+  // rank. Phases are timed with a Scope, which may live on any thread
+  class PhaseTimers {
+    public:
+    explicit PhaseTimers(const std::vector<std::string> & phases)
+      : names_(phases), seconds_(phases.size(), 0.0), bytes_(phases.size(), 0.0),
+        calls_(phases.size(), 0) {}
+
+    // adds the time from its construction to its destruction to the phase
+    class Scope {
+      public:
+      Scope(PhaseTimers & timers, const std::string & phase)
+        : timers_(timers), phase_(timers.index(phase)),
+          start_(std::chrono::steady_clock::now()) {}
+      ~Scope() {
+        const std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start_;
+        timers_.add(phase_, elapsed.count(), 0.0, 1);
+      }
+      Scope(const Scope &) = delete;
+      Scope & operator=(const Scope &) = delete;
+
+      private:
+      PhaseTimers & timers_;
+      const size_t phase_;
+      const std::chrono::steady_clock::time_point start_;
+    };
+
+    void addBytes(const std::string & phase, const double bytes) {
+      add(index(phase), 0.0, bytes, 0);
+    }
+
+    // largest resident set size of this process so far, in bytes
+    static double peakRSS() {
+      struct rusage usage;
+      getrusage(RUSAGE_SELF, &usage);
+      return static_cast<double>(usage.ru_maxrss) * 1024.0;   // kilobytes on Linux
+    }
+
+    // seconds of every phase, bytes of every phase and peak RSS of each rank of comm,
+    // one rank after the other, on root only
+    std::vector<double> gather(const eckit::mpi::Comm & comm, const size_t root) const {
+      const std::vector<double> local = row();
+      std::vector<double> all(comm.rank() == root ? local.size() * comm.size() : 0);
+      MPI_Gather(local.data(), local.size(), MPI_DOUBLE, all.data(), local.size(), MPI_DOUBLE,
+                 root, MPI_Comm_f2c(comm.communicator()));
+      return all;
+    }
+    // the gathered numbers of rank with its phases timed since the gather (the writing
+    // on root)
+    void update(std::vector<double> & all, const size_t rank) const {
+      const std::vector<double> local = row();
+      std::copy(local.begin(), local.end(), all.begin() + rank * local.size());
+    }
+
+    // over the ranks of the gathered numbers
+    double maxSeconds(const std::vector<double> & all, const size_t phase) const {
+      double result = 0.0;
+      for (size_t r = 0; r < all.size() / stride(); r++) {
+        result = std::max(result, all[r * stride() + phase]);
+      }
+      return result;
+    }
+    double totalBytes(const std::vector<double> & all, const size_t phase) const {
+      double result = 0.0;
+      for (size_t r = 0; r < all.size() / stride(); r++) {
+        result += all[r * stride() + names_.size() + phase];
+      }
+      return result;
+    }
+    double maxPeakRSS(const std::vector<double> & all) const {
+      double result = 0.0;
+      for (size_t r = 0; r < all.size() / stride(); r++) {
+        result = std::max(result, all[(r + 1) * stride() - 1]);
+      }
+      return result;
+    }
+
+    const std::vector<std::string> & phases() const { return names_; }
+
+    // the gathered numbers as a JSON object, every rank and the totals over the ranks
+    std::string json(const std::string & name, const std::vector<double> & all) const {
+      const size_t nranks = all.size() / stride();
+      std::ostringstream os;
+      os.precision(9);
+      os << "{\"obs space\": \"" << name << "\", \"ranks\": " << nranks << ", \"phases\": {";
+      for (size_t p = 0; p < names_.size(); p++) {
+        os << (p > 0 ? ", " : "") << "\"" << names_[p] << "\": {\"calls\": " << calls_[p]
+           << ", \"seconds\": " << column(all, p) << ", \"bytes\": "
+           << column(all, names_.size() + p) << ", \"max seconds\": " << maxSeconds(all, p)
+           << ", \"total bytes\": " << totalBytes(all, p) << "}";
+      }
+      os << "}, \"peak rss bytes\": " << column(all, stride() - 1)
+         << ", \"max peak rss bytes\": " << maxPeakRSS(all) << "}";
+      return os.str();
+    }
+
+    private:
+    size_t stride() const { return 2 * names_.size() + 1; }
+    size_t index(const std::string & phase) const {
+      const auto it = std::find(names_.begin(), names_.end(), phase);
+      if (it == names_.end()) throw eckit::BadValue("PhaseTimers: unknown phase " + phase);
+      return it - names_.begin();
+    }
+    void add(const size_t phase, const double seconds, const double bytes, const size_t calls) {
+      std::lock_guard<std::mutex> lock(mutex_);
+      seconds_[phase] += seconds;
+      bytes_[phase] += bytes;
+      calls_[phase] += calls;
+    }
+    std::vector<double> row() const {
+      std::vector<double> local(seconds_);
+      local.insert(local.end(), bytes_.begin(), bytes_.end());
+      local.push_back(peakRSS());
+      return local;
+    }
+    // entry k of every rank as a JSON array
+    std::string column(const std::vector<double> & all, const size_t k) const {
+      std::ostringstream os;
+      os.precision(9);
+      os << "[";
+      for (size_t r = 0; r < all.size() / stride(); r++) {
+        os << (r > 0 ? ", " : "") << all[r * stride() + k];
+      }
+      os << "]";
+      return os.str();
+    }
+
+    const std::vector<std::string> names_;
+    std::vector<double> seconds_;
+    std::vector<double> bytes_;
+    std::vector<size_t> calls_;
+    std::mutex mutex_;
+  };
+}  // namespace dautils